@@ -0,0 +1,154 @@
+// Benchmark for Board::isLegalBatch against one Board::isLegal call per pair, fill step included.
+// Positions come from random games played on a Board; each gets PAIRS candidate moves, half of
+// them legal and half a random piece of the side to move sent to a random square. Batches of
+// BATCH_SIZE pairs are filled, checked and cleared, the way a validation pipeline reuses them.
+// Build: g++ -std=c++17 -O2 -march=native batchBench.cpp -o batchBench
+// Usage: batchBench [games=200]
+// Exits with status 1 if a batch result differs from isLegal.
+#include "chessRule.cpp"
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <random>
+
+static const int PAIRS = 16;
+static const size_t BATCH_SIZE = 4096;
+
+typedef std::chrono::steady_clock Clock;
+
+static double since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct BatchTimes {
+    std::vector<uint8_t> legal;
+    double fill = 0;
+    double check = 0;
+    size_t mismatches = 0;
+};
+
+// Checks a full batch against the isLegal results and clears both
+static void runBatch(Board::PositionBatch& batch, std::vector<uint8_t>& expected, BatchTimes& times) {
+    auto start = Clock::now();
+    Board::isLegalBatch(batch, times.legal);
+    times.check += since(start);
+    for (size_t i = 0; i < times.legal.size(); i++) {
+        times.mismatches += times.legal[i] != expected[i];
+    }
+    batch.clear();
+}
+
+int main(int argc, char** argv) {
+    int games = argc > 1 ? atoi(argv[1]) : 200;
+    std::mt19937_64 rng(2024);
+    Board::PositionBatch boardBatch, compactBatch;
+    std::vector<uint8_t> expected;
+    BatchTimes boardTimes, compactTimes;
+    double isLegalSeconds = 0;
+    size_t pairs = 0, legalCount = 0;
+
+    for (int game = 0; game < games; game++) {
+        Board board;
+        board.consoleMessages = false;
+        std::vector<std::unique_ptr<Piece>> pieces; // Board does not own its pieces
+        auto place = [&](Piece* piece, int x, int y) {
+            pieces.emplace_back(piece);
+            board.placePiece(piece, {x, y});
+        };
+        for (int color = 0; color < 2; color++) {
+            bool white = color == 0;
+            int home = white ? 0 : 7;
+            place(new Rook(white), 0, home);
+            place(new Knight(white), 1, home);
+            place(new Bishop(white), 2, home);
+            place(new Queen(white), 3, home);
+            place(new King(white), 4, home);
+            place(new Bishop(white), 5, home);
+            place(new Knight(white), 6, home);
+            place(new Rook(white), 7, home);
+            for (int x = 0; x < 8; x++) {
+                place(new Pawn(white), x, white ? 1 : 6);
+            }
+        }
+        board.initializeBoardHistory();
+
+        CompactPosition position = CompactPosition::startPosition();
+        uint16_t moves[CompactPosition::MAX_MOVES];
+        for (int ply = 0; ply < 200; ply++) {
+            int count = position.generateLegalMoves(moves);
+            if (count == 0 || position.status(count) != GameStatus::Ongoing) {
+                break;
+            }
+            uint64_t own = position.byColor[position.whiteToMove ? 0 : 1];
+            uint16_t candidates[PAIRS];
+            for (int i = 0; i < PAIRS; i++) {
+                if (i % 2 == 0) {
+                    candidates[i] = moves[rng() % count] & 0xFFF; // Promotion piece is not part of the pair
+                } else {
+                    uint64_t from = own;
+                    for (int skip = rng() % __builtin_popcountll(own); skip > 0; skip--) {
+                        from &= from - 1;
+                    }
+                    candidates[i] = packMove(__builtin_ctzll(from), rng() % 64);
+                }
+            }
+
+            auto start = Clock::now();
+            for (int i = 0; i < PAIRS; i++) {
+                int from = moveFrom(candidates[i]), to = moveTo(candidates[i]);
+                expected.push_back(board.isLegal({from % 8, from / 8}, {to % 8, to / 8}));
+            }
+            isLegalSeconds += since(start);
+
+            start = Clock::now();
+            for (int i = 0; i < PAIRS; i++) {
+                int from = moveFrom(candidates[i]), to = moveTo(candidates[i]);
+                board.appendToBatch(boardBatch, {from % 8, from / 8}, {to % 8, to / 8});
+            }
+            boardTimes.fill += since(start);
+
+            start = Clock::now();
+            for (int i = 0; i < PAIRS; i++) {
+                compactBatch.append(position, candidates[i]);
+            }
+            compactTimes.fill += since(start);
+
+            if (expected.size() >= BATCH_SIZE) {
+                runBatch(boardBatch, expected, boardTimes);
+                runBatch(compactBatch, expected, compactTimes);
+                pairs += expected.size();
+                for (uint8_t legal : expected) {
+                    legalCount += legal;
+                }
+                expected.clear();
+            }
+
+            uint16_t move = moves[rng() % count];
+            int from = moveFrom(move), to = moveTo(move);
+            board.movePiece({from % 8, from / 8}, {to % 8, to / 8}, movePromotion(move) ? "PNBRQK"[movePromotion(move)] : 'Q');
+            if (movePromotion(move)) {
+                pieces.emplace_back(board.board[to / 8][to % 8]);
+            }
+            position.makeMove(move);
+        }
+    }
+    // Pairs left over from the last batch are not checked; the fill times above include them
+    isLegalSeconds *= (double)pairs / (pairs + expected.size());
+    boardTimes.fill *= (double)pairs / (pairs + expected.size());
+    compactTimes.fill *= (double)pairs / (pairs + expected.size());
+
+#if defined(__AVX512F__)
+    const char* kernel = "AVX-512, 8 lanes";
+#elif defined(__AVX2__)
+    const char* kernel = "AVX2, 4 lanes";
+#else
+    const char* kernel = "scalar";
+#endif
+    size_t mismatches = boardTimes.mismatches + compactTimes.mismatches;
+    std::cout << "pairs:                  " << pairs << " (" << legalCount << " legal), " << mismatches << " mismatches" << std::endl;
+    std::cout << "isLegal, one call each: " << (long long)(pairs / isLegalSeconds) << " pairs/s" << std::endl;
+    std::cout << "isLegalBatch (" << kernel << "): " << (long long)(pairs / boardTimes.check) << " pairs/s" << std::endl;
+    std::cout << "  filled from Board:           " << (long long)(pairs / (boardTimes.fill + boardTimes.check)) << " pairs/s" << std::endl;
+    std::cout << "  filled from CompactPosition: " << (long long)(pairs / (compactTimes.fill + compactTimes.check)) << " pairs/s" << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
@@ -1,9 +1,181 @@
 #include <iostream>
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <typeinfo>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 // Forward declaration
 class Piece;
 
+// Fixed-capacity ring buffer; pushing onto a full ring drops the oldest entry
+template <class T, int Capacity>
+class HistoryRing {
+    public:
+        void push_back(const T& value) {
+            entries[(start + count) % Capacity] = value;
+            if (count < Capacity) {
+                count++;
+            } else {
+                start = (start + 1) % Capacity;
+            }
+        }
+        void clear() { start = 0; count = 0; }
+        bool empty() const { return count == 0; }
+        int size() const { return count; }
+        const T& operator[](int i) const { return entries[(start + i) % Capacity]; } // 0 is the oldest
+        const T& back() const { return (*this)[count - 1]; }
+    private:
+        T entries[Capacity];
+        int start = 0;
+        int count = 0;
+};
+
+// Full keeps every move, board state and repetition state; Bounded keeps only the last 128
+// repetition states, which is what draw detection needs within the fifty-move window
+enum class HistoryMode { Full, Bounded };
+
+// Piece type index used by the bitboard representations
+enum PieceIndex { PAWN = 0, KNIGHT, BISHOP, ROOK, QUEEN, KING, PIECE_TYPES };
+
+// Side as a compile-time parameter, so colour-dependent rules carry no runtime branches
+enum class Color { White, Black };
+
+template <Color C> struct ColorTraits;
+
+template <> struct ColorTraits<Color::White> {
+    static constexpr bool white = true;
+    static constexpr Color opponent = Color::Black;
+    static constexpr int forward = 1; // Pawn direction along y
+    static constexpr int homeRank = 0; // King and rook starting row
+    static constexpr int pawnStartRank = 1;
+    static constexpr int promotionRank = 7;
+};
+
+template <> struct ColorTraits<Color::Black> {
+    static constexpr bool white = false;
+    static constexpr Color opponent = Color::White;
+    static constexpr int forward = -1;
+    static constexpr int homeRank = 7;
+    static constexpr int pawnStartRank = 6;
+    static constexpr int promotionRank = 0;
+};
+
+enum class GameStatus : uint8_t {
+    Ongoing, WhiteWins, BlackWins, Stalemate,
+    DrawByRepetition, DrawByFiftyMoves, DrawByInsufficientMaterial,
+    IllegalMove, UnknownGame
+};
+
+// Moves of the bitboard code are packed as from | to << 6 | promotion << 12,
+// with squares numbered x + 8 * y and promotion a PieceIndex (0 if none).
+inline uint16_t packMove(int from, int to, int promotion = 0) { return from | to << 6 | promotion << 12; }
+inline int moveFrom(uint16_t move) { return move & 63; }
+inline int moveTo(uint16_t move) { return (move >> 6) & 63; }
+inline int movePromotion(uint16_t move) { return move >> 12; }
+
+// Coordinate text of a packed move, such as e2e4 or e7e8q
+inline std::string moveText(uint16_t move) {
+    std::string text = {char('a' + moveFrom(move) % 8), char('1' + moveFrom(move) / 8),
+                        char('a' + moveTo(move) % 8), char('1' + moveTo(move) / 8)};
+    if (movePromotion(move)) {
+        text += "pnbrqk"[movePromotion(move)];
+    }
+    return text;
+}
+
+// Material values used by static exchange evaluation and material balance, in centipawns
+constexpr int PIECE_VALUES[PIECE_TYPES] = {100, 300, 300, 500, 900, 0};
+
+// Small random generator for self-play and search; state is the seed, and streams seeded
+// with different values are independent enough for move choice
+struct SplitMix64 {
+    uint64_t state;
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint32_t below(uint32_t bound) { return (uint32_t)(((next() >> 32) * bound) >> 32); }
+};
+
+// Fixed-size 80-byte position with its own legal move generator, for places where a Board
+// with heap pieces and unbounded history is too heavy (many live games, self-play).
+class CompactPosition {
+    public:
+        uint64_t byType[PIECE_TYPES];
+        uint64_t byColor[2]; // [0] white, [1] black
+        uint64_t key; // Same Zobrist key as Board::positionKey
+        uint8_t castling; // 1 white kingside, 2 white queenside, 4 black kingside, 8 black queenside
+        int8_t enPassant; // Square passed over by the last double pawn push, -1 if none
+        bool whiteToMove;
+        uint8_t rule50; // Player moves since the last pawn move or capture
+        uint16_t ply;
+        
+        static const int MAX_MOVES = 256;
+        static CompactPosition startPosition();
+        uint64_t pieces(int color, int type) const { return byColor[color] & byType[type]; }
+        uint64_t occupied() const { return byColor[0] | byColor[1]; }
+        int pieceOn(int square) const; // PieceIndex, or -1 if empty
+        bool inCheck() const;
+        uint64_t attackersTo(int square, uint64_t occupied) const; // Both colours, sliders seen through empty squares of occupied
+        int see(uint16_t move) const; // Material won by the exchange on the destination; pins are ignored
+        bool seeGe(uint16_t move, int threshold) const; // see(move) >= threshold, stopping as soon as it is decided
+        int generateLegalMoves(uint16_t* moves) const; // Returns the number of moves written
+        bool hasLegalMove() const;
+        bool isLegal(uint16_t move) const;
+        void makeMove(uint16_t move); // Move must be legal; a promotion without a piece becomes a queen
+        bool isInsufficientMaterial() const;
+        int materialBalance() const; // PIECE_VALUES of the side to move minus the opponent's
+        GameStatus status(int legalMoves) const; // Mate, stalemate and draws other than repetition; any count > 0 will do
+        uint64_t computeKey() const;
+    private:
+        template <Color C> bool isAttackedBy(int square) const;
+        template <Color C> int generatePseudoLegalMovesAs(uint16_t* moves) const;
+        template <Color C> bool leavesKingSafe(uint16_t move) const;
+        template <Color C> void makeMoveAs(uint16_t move);
+};
+
+// Keys of the CompactPosition positions since the last irreversible move, for repetition
+// checks. Past 128 entries the oldest are dropped, which the fifty-move rule never reaches.
+class KeyHistory {
+    public:
+        void reset(const CompactPosition& position) { keys.clear(); keys.push_back(position.key); }
+        void push(const CompactPosition& position) { // After each move; a pawn move or capture starts over
+            if (position.rule50 == 0) {
+                keys.clear();
+            }
+            keys.push_back(position.key);
+        }
+        int repetitions(int limit) const; // Earlier occurrences of the last position, counted up to limit
+    private:
+        HistoryRing<uint64_t, 128> keys;
+};
+
+// 32-byte position record with training labels, meaningful outside the process.
+// occupied has a bit per piece; pieces holds a 4-bit code for each, lowest square first,
+// low nibble first. Codes 0-5 are white PieceIndex values and 6-11 black ones; the spare
+// codes carry the rest of the state: 12 is the pawn that just made a double push (en
+// passant), 13 and 14 a white or black rook that still has its castling right, and 15 the
+// black king when black is to move.
+struct PackedPosition {
+    uint64_t occupied;
+    uint8_t pieces[16];
+    uint8_t rule50;
+    int8_t result; // 1 white won, -1 black won, 0 draw or unknown
+    uint16_t fullmove; // Starts at 1, incremented after black's move
+    int16_t eval; // Centipawns for the side to move, 0 if unknown
+    uint16_t bestMove; // packMove format, 0 if none
+    
+    bool pack(const CompactPosition& position); // False with more than 32 pieces; clears the labels
+    CompactPosition unpack() const;
+};
+static_assert(sizeof(PackedPosition) == 32, "PackedPosition is a 32-byte on-disk record");
+
 class Board{
     public:
         Piece* board[8][8] = {{nullptr}};
@@ -25,15 +197,55 @@ class Board{
             std::pair<int, int> enPassantTarget; // {-1, -1} if no en passant possible
         };
         std::vector<BoardState> boardHistory;
+        
+        // Hash and reversible-move bookkeeping for each saved state since the last irreversible move.
+        // Full mode keeps all of them; Bounded keeps the last BOUNDED_STATES, which cover the
+        // fifty-move window.
+        static const int BOUNDED_STATES = 128;
+        struct StateInfo {
+            uint64_t key; // Zobrist key, including side to move
+            int rule50; // Player moves since the last pawn move or capture
+            int repetition; // Plies back to the same position, negative if that one was a repetition too, 0 if none
+            int pieceCount;
+        };
+        std::vector<StateInfo> stateHistory;
+        
+        // In Bounded mode moveHistory and boardHistory stay empty; gameLog optionally keeps
+        // every player move as packMove(from, to, promotion) (squares numbered x + 8 * y,
+        // promotion the PieceIndex chosen or 0) in either mode.
+        HistoryMode historyMode = HistoryMode::Full;
+        bool keepGameLog = false;
+        bool consoleMessages = true; // movePiece reports promotions and invalid moves on std::cout
+        std::vector<uint16_t> gameLog;
+        
+        // Structure-of-arrays bitboards for checking many (position, move) pairs at once.
+        // Index i of every array belongs to position i; squares are numbered x + 8 * y.
+        struct PositionBatch {
+            std::vector<uint64_t> pieces[2][PIECE_TYPES]; // [0] white, [1] black
+            std::vector<uint64_t> castlingTargets; // King destinations still allowed for castling (c1, g1, c8, g8)
+            std::vector<uint64_t> enPassant; // Square passed over by a double pawn push, 0 if none
+            std::vector<uint8_t> from; // Candidate move for each position
+            std::vector<uint8_t> to;
+            size_t size() const { return from.size(); }
+            void append(const CompactPosition& position, uint16_t move); // Move in packMove format
+            void clear(); // Keeps the capacity for the next batch
+        };
+        
+        struct LegalTargets {
+            uint64_t squares; // Bit x + 8 * y for each destination isLegal accepts
+            uint64_t promotions; // Subset of squares where the move promotes a pawn
+        };
               
         bool isOccupied(const std::pair<int, int>& pos) const;
         bool isOccupiedByWhite(const std::pair<int, int>& pos) const;
         void placePiece(Piece* piece, const std::pair<int, int>& pos);
         void removePiece(const std::pair<int, int>& pos);        
-        void movePiece(const std::pair<int, int>& from, const std::pair<int, int>& to);
+        void movePiece(const std::pair<int, int>& from, const std::pair<int, int>& to, char promotion = 'Q');
         void promotePawn(const std::pair<int, int>& pos, char pieceType);
         bool isCheck(bool white) const;
+        template <Color C> bool isCheck() const;
         bool isLegal(const std::pair<int, int>& from, const std::pair<int, int>& to);
+        LegalTargets legalTargets(const std::pair<int, int>& from); // Cached until the position changes
         bool isCheckmate(bool white);
         bool isDrawByStalemate(bool white);        
         bool isDrawByRepetition() const;
@@ -44,13 +256,39 @@ class Board{
         void saveBoardState();
         BoardState getCurrentBoardState() const;
         void initializeBoardHistory(); // Save initial board state
+        void appendToBatch(PositionBatch& batch, const std::pair<int, int>& from, const std::pair<int, int>& to) const; // Via compactPosition()
+        static void isLegalBatch(const PositionBatch& batch, std::vector<uint8_t>& legal);
+        uint64_t positionKey(const BoardState& state, bool whiteToMove) const;
+        bool hasUpcomingRepetition(int ply) const; // Side to move can repeat a position with its next move
+        void setHistoryMode(HistoryMode mode);
+        const Move* lastMove() const; // nullptr before the first move
+        bool isWhiteToMove() const; // Alternates from white at the first saved state
+        int see(const std::pair<int, int>& from, const std::pair<int, int>& to) const;
+        bool seeGe(const std::pair<int, int>& from, const std::pair<int, int>& to, int threshold) const;
+        CompactPosition compactPosition() const; // Cached until the position changes
+        bool isDrawInSearch(int ply) const; // Fifty moves, or a repetition inside the last ply plies of search
     private:
-        bool isSamePosition(int moveIndex1, int moveIndex2) const;
+        Move lastMoveRecord;
+        bool hasLastMove = false;
+        int savedStates = 0;
+        std::vector<const Piece*> movedPieces; // Each piece that has moved, at most once
+        // legalTargets results for the position whose last saved state has key targetCacheKey
+        LegalTargets targetCache[64];
+        uint64_t targetCacheFilled = 0; // Squares whose targetCache entry is current
+        uint64_t targetCacheKey = 0;
+        // compactPosition() result, until the board changes or a state is saved
+        mutable CompactPosition compactCache;
+        mutable bool compactCacheValid = false;
+        void recordMove(const Move& move);
+        template <Color C> bool isLegalAs(const std::pair<int, int>& from, const std::pair<int, int>& to);
+        template <Color C> bool hasLegalMove();
+        template <Color C> bool isEnPassantCapture(const std::pair<int, int>& from, const std::pair<int, int>& to) const;
 };
 
 class Piece{
     public:
         Piece(bool W) : white(W) {}
+        virtual ~Piece() = default;
         bool white;
         
         virtual bool canMoveTo(const Board* board, const std::pair<int, int>& to);
@@ -60,6 +298,7 @@ class Pawn : public Piece{
     public:
         Pawn(bool W) : Piece(W) {}
         bool canMoveTo(const Board* board, const std::pair<int, int>& to) override;
+        template <Color C> bool canMoveToAs(const Board* board, const std::pair<int, int>& to);
 };
 
 class Knight : public Piece{
@@ -90,10 +329,18 @@ class King : public Piece{
     public:
         King(bool W) : Piece(W) {}
         bool canMoveTo(const Board* board, const std::pair<int, int>& to) override;
+        template <Color C> bool canMoveToAs(const Board* board, const std::pair<int, int>& to);
 };
 
 // Board method implementations
 bool Board::isCheck(bool white) const {
+    return white ? isCheck<Color::White>() : isCheck<Color::Black>();
+}
+
+template <Color C>
+bool Board::isCheck() const {
+    constexpr bool white = ColorTraits<C>::white;
+    constexpr Color enemy = ColorTraits<C>::opponent;
     // Find the king of the specified color
     for(int y = 0; y < 8; y++) {
         for(int x = 0; x < 8; x++) {
@@ -105,10 +352,22 @@ bool Board::isCheck(bool white) const {
                 for(int ey = 0; ey < 8; ey++) {
                     for(int ex = 0; ex < 8; ex++) {
                         Piece* enemyPiece = board[ey][ex];
-                        if(enemyPiece != nullptr && enemyPiece->white != white) {
-                            if(enemyPiece->canMoveTo(this, kingPos)) {
-                                return true; // King is in check
-                            }
+                        if(enemyPiece == nullptr || enemyPiece->white == white) {
+                            continue;
+                        }
+                        // Pawns and kings are the colour-dependent pieces; call their
+                        // enemy-colour rules directly instead of dispatching on white again
+                        const std::type_info& type = typeid(*enemyPiece);
+                        bool attacks;
+                        if (type == typeid(Pawn)) {
+                            attacks = static_cast<Pawn*>(enemyPiece)->canMoveToAs<enemy>(this, kingPos);
+                        } else if (type == typeid(King)) {
+                            attacks = static_cast<King*>(enemyPiece)->canMoveToAs<enemy>(this, kingPos);
+                        } else {
+                            attacks = enemyPiece->canMoveTo(this, kingPos);
+                        }
+                        if(attacks) {
+                            return true; // King is in check
                         }
                     }
                 }
@@ -130,194 +389,134 @@ bool Board::isLegal(const std::pair<int, int>& from, const std::pair<int, int>&
     if(piece == nullptr) {
         return false;
     }
+    return piece->white ? isLegalAs<Color::White>(from, to) : isLegalAs<Color::Black>(from, to);
+}
+
+template <Color C>
+bool Board::isLegalAs(const std::pair<int, int>& from, const std::pair<int, int>& to) {
+    Piece* piece = board[from.second][from.first];
+    const std::type_info& type = typeid(*piece);
+    Pawn* pawn = type == typeid(Pawn) ? static_cast<Pawn*>(piece) : nullptr;
+    King* king = type == typeid(King) ? static_cast<King*>(piece) : nullptr;
     
     // First check if the piece can actually make this move
-    if(!piece->canMoveTo(this, to)) {
+    bool canMove = pawn ? pawn->canMoveToAs<C>(this, to)
+                 : king ? king->canMoveToAs<C>(this, to)
+                 : piece->canMoveTo(this, to);
+    if(!canMove) {
         return false;
     }
     
-    // Make a temporary move to check if it leaves king in check
+    // Make a temporary move to check if it leaves king in check; an en passant capture
+    // also removes the pawn beside the destination
+    bool isEnPassant = pawn && isEnPassantCapture<C>(from, to);
+    Piece* enPassantVictim = isEnPassant ? board[from.second][to.first] : nullptr;
     Piece* captured = board[to.second][to.first];
     board[to.second][to.first] = piece;
     board[from.second][from.first] = nullptr;
+    if (isEnPassant) {
+        board[from.second][to.first] = nullptr;
+    }
     
-    bool kingInCheck = isCheck(piece->white);
+    bool kingInCheck = isCheck<C>();
     
     // Restore the board
     board[from.second][from.first] = piece;
     board[to.second][to.first] = captured;
+    if (isEnPassant) {
+        board[from.second][to.first] = enPassantVictim;
+    }
     
     return !kingInCheck; // Move is legal if king is not in check after move
 }
 
-bool Board::isCheckmate(bool white) {
-    // If king is not in check, it's not checkmate
-    if(!isCheck(white)) {
-        return false;
+Board::LegalTargets Board::legalTargets(const std::pair<int, int>& from) {
+    if (from.first < 0 || from.first > 7 || from.second < 0 || from.second > 7) {
+        return {0, 0};
+    }
+    // A different saved state means a different position even if no mutator was called
+    uint64_t key = stateHistory.empty() ? 0 : stateHistory.back().key;
+    if (key != targetCacheKey) {
+        targetCacheKey = key;
+        targetCacheFilled = 0;
     }
     
-    // Check if any piece of this color has a legal move
-    for(int fy = 0; fy < 8; fy++) {
-        for(int fx = 0; fx < 8; fx++) {
-            Piece* piece = board[fy][fx];
-            if(piece != nullptr && piece->white == white) {
-                // Try all possible destination squares
-                for(int ty = 0; ty < 8; ty++) {
-                    for(int tx = 0; tx < 8; tx++) {
-                        if(isLegal({fx, fy}, {tx, ty})) {
-                            return false; // Found a legal move, not checkmate
-                        }
+    int square = from.first + 8 * from.second;
+    if (targetCacheFilled & (1ULL << square)) {
+        return targetCache[square];
+    }
+    
+    LegalTargets targets = {0, 0};
+    Piece* piece = board[from.second][from.first];
+    if (piece != nullptr) {
+        bool pawn = dynamic_cast<Pawn*>(piece) != nullptr;
+        int promotionRank = piece->white ? ColorTraits<Color::White>::promotionRank
+                                         : ColorTraits<Color::Black>::promotionRank;
+        for (int y = 0; y < 8; y++) {
+            for (int x = 0; x < 8; x++) {
+                Piece* target = board[y][x];
+                if (target != nullptr && target->white == piece->white) {
+                    continue; // Never a destination, skip the make/unmake
+                }
+                if (isLegal(from, {x, y})) {
+                    targets.squares |= 1ULL << (x + 8 * y);
+                    if (pawn && y == promotionRank) {
+                        targets.promotions |= 1ULL << (x + 8 * y);
                     }
                 }
             }
         }
     }
-    return true; // No legal moves found, it's checkmate
+    targetCache[square] = targets;
+    targetCacheFilled |= 1ULL << square;
+    return targets;
+}
+
+bool Board::isCheckmate(bool white) {
+    // Checkmate: king in check and no legal move
+    if (white) {
+        return isCheck<Color::White>() && !hasLegalMove<Color::White>();
+    }
+    return isCheck<Color::Black>() && !hasLegalMove<Color::Black>();
 }
 
 bool Board::isDrawByStalemate(bool white) {
-    // If king is in check, it's not stalemate (could be checkmate)
-    if(isCheck(white)) {
-        return false;
+    // Stalemate: king not in check but no legal move
+    if (white) {
+        return !isCheck<Color::White>() && !hasLegalMove<Color::White>();
     }
-    
+    return !isCheck<Color::Black>() && !hasLegalMove<Color::Black>();
+}
+
+template <Color C>
+bool Board::hasLegalMove() {
     // Check if any piece of this color has a legal move
     for(int fy = 0; fy < 8; fy++) {
         for(int fx = 0; fx < 8; fx++) {
             Piece* piece = board[fy][fx];
-            if(piece != nullptr && piece->white == white) {
+            if(piece != nullptr && piece->white == ColorTraits<C>::white) {
                 // Try all possible destination squares
                 for(int ty = 0; ty < 8; ty++) {
                     for(int tx = 0; tx < 8; tx++) {
-                        if(isLegal({fx, fy}, {tx, ty})) {
-                            return false; // Found a legal move, not stalemate
+                        if(isLegalAs<C>({fx, fy}, {tx, ty})) {
+                            return true;
                         }
                     }
                 }
             }
         }
     }
-    return true; // No legal moves found and not in check, it's stalemate
-}
-
-bool Board::isDrawByRepetition() const {
-    if (boardHistory.size() < 8) { // Need at least 4 full moves (8 half-moves) for threefold repetition
-        return false;
-    }
-    
-    // Count how many times the current position has occurred
-    int repetitionCount = 1; // Current position counts as 1
-    int currentBoardIndex = boardHistory.size() - 1;
-    
-    // Helper function to check if a move is a king castling move
-    auto isKingCastlingMove = [&](int idx) -> bool {
-        if (idx >= moveHistory.size()) return false;
-        const Move& move = moveHistory[idx];
-        return dynamic_cast<King*>(move.piece) && abs(move.to.first - move.from.first) == 2;
-    };
-    
-    // Function to count actual player moves (considering castling as one move)
-    auto countPlayerMoves = [&](int fromIndex, int toIndex) -> int {
-        int playerMoves = 0;
-        for (int i = fromIndex; i <= toIndex; i++) {
-            if (isKingCastlingMove(i)) {
-                playerMoves++; // Castling counts as one player move
-                i++; // Skip the rook move that follows
-            } else {
-                playerMoves++; // Regular move
-            }
-        }
-        return playerMoves;
-    };
-    
-    // Current position player moves count
-    int currentPlayerMoves = countPlayerMoves(0, moveHistory.size() - 1);
-    
-    // Start from previous board states and go back, looking for positions with same player to move
-    for (int i = boardHistory.size() - 2; i >= 0; i--) {
-        // Count player moves up to position i
-        int playerMovesToI = countPlayerMoves(0, i);
-        
-        // Check if we have the same player to move by comparing parity
-        if (currentPlayerMoves % 2 == playerMovesToI % 2) {
-            if (isSamePosition(currentBoardIndex, i)) {
-                repetitionCount++;
-                if (repetitionCount >= 3) {
-                    return true; // Threefold repetition
-                }
-            }
-        }
-    }
-    
     return false;
 }
 
-bool Board::isSamePosition(int moveIndex1, int moveIndex2) const {
-    if (moveIndex1 < 0 || moveIndex2 < 0 || 
-        moveIndex1 >= boardHistory.size() || moveIndex2 >= boardHistory.size()) {
-        return false;
-    }
-    
-    // If both indices point to the same position, they're obviously the same
-    if (moveIndex1 == moveIndex2) {
-        return true;
-    }
-    
-    const BoardState& state1 = boardHistory[moveIndex1];
-    const BoardState& state2 = boardHistory[moveIndex2];
-    
-    // Compare piece positions on all squares
-    for (int y = 0; y < 8; y++) {
-        for (int x = 0; x < 8; x++) {
-            Piece* piece1 = state1.board[y][x];
-            Piece* piece2 = state2.board[y][x];
-            
-            // Compare pieces at this position
-            if (piece1 == nullptr && piece2 == nullptr) {
-                continue; // Both empty, ok
-            }
-            
-            if (piece1 == nullptr || piece2 == nullptr) {
-                return false; // One empty, one occupied
-            }
-            
-            // Both positions have pieces - compare their types and colors
-            if (piece1->white != piece2->white) {
-                return false; // Different colors
-            }
-            
-            // Check piece types by comparing dynamic casts
-            if ((dynamic_cast<Pawn*>(piece1) != nullptr) != (dynamic_cast<Pawn*>(piece2) != nullptr) ||
-                (dynamic_cast<Knight*>(piece1) != nullptr) != (dynamic_cast<Knight*>(piece2) != nullptr) ||
-                (dynamic_cast<Bishop*>(piece1) != nullptr) != (dynamic_cast<Bishop*>(piece2) != nullptr) ||
-                (dynamic_cast<Rook*>(piece1) != nullptr) != (dynamic_cast<Rook*>(piece2) != nullptr) ||
-                (dynamic_cast<Queen*>(piece1) != nullptr) != (dynamic_cast<Queen*>(piece2) != nullptr) ||
-                (dynamic_cast<King*>(piece1) != nullptr) != (dynamic_cast<King*>(piece2) != nullptr)) {
-                return false; // Different piece types
-            }
-        }
-    }
-    
-    // Compare castling rights (essential for threefold repetition)
-    if (state1.whiteCanCastleKingside != state2.whiteCanCastleKingside ||
-        state1.whiteCanCastleQueenside != state2.whiteCanCastleQueenside ||
-        state1.blackCanCastleKingside != state2.blackCanCastleKingside ||
-        state1.blackCanCastleQueenside != state2.blackCanCastleQueenside) {
-        return false; // Different castling rights
-    }
-    
-    // Compare en passant target squares
-    if (state1.enPassantTarget != state2.enPassantTarget) {
-        return false; // Different en passant possibilities
-    }
-    
-    return true; // Positions are identical
+bool Board::isDrawByRepetition() const {
+    // Threefold: the previous occurrence of this position was itself a repetition
+    return !stateHistory.empty() && stateHistory.back().repetition < 0;
 }
 
 bool Board::hasPieceMoved(const Piece* piece) const {
-    // Check if the piece appears in move history
-    for (const Move& move : moveHistory) {
-        if (move.piece == piece) {
+    for (const Piece* moved : movedPieces) {
+        if (moved == piece) {
             return true;
         }
     }
@@ -325,72 +524,9 @@ bool Board::hasPieceMoved(const Piece* piece) const {
 }
 
 bool Board::isDrawByFiftyMoves() const {
-    if (moveHistory.size() < 100) { // 50 moves by each side = 100 half-moves
-        return false;
-    }
-    
-    // Helper function to check if a move is a king castling move
-    auto isKingCastlingMove = [&](int idx) -> bool {
-        if (idx >= moveHistory.size() || idx < 0) return false;
-        const Move& move = moveHistory[idx];
-        return dynamic_cast<King*>(move.piece) && abs(move.to.first - move.from.first) == 2;
-    };
-    
-    // Helper function to count pieces on a board state
-    auto countPieces = [](const BoardState& state) -> int {
-        int count = 0;
-        for (int y = 0; y < 8; y++) {
-            for (int x = 0; x < 8; x++) {
-                if (state.board[y][x] != nullptr) {
-                    count++;
-                }
-            }
-        }
-        return count;
-    };
-    
-    // Count moves since last pawn move or capture
-    int movesSinceLastPawnMoveOrCapture = 0;
-    
-    // Go through move history from most recent backwards
-    for (int i = moveHistory.size() - 1; i >= 0; i--) {
-        const Move& move = moveHistory[i];
-        
-        // Check if this was a pawn move
-        if (dynamic_cast<Pawn*>(move.piece)) {
-            break; // Found pawn move, reset counter
-        }
-        
-        // Check if this was a capture by comparing piece counts
-        // boardHistory[i] is the state before move i, boardHistory[i+1] is after move i
-        if (i + 1 < boardHistory.size() && i >= 0) {
-            int piecesBefore = countPieces(boardHistory[i]);
-            int piecesAfter = countPieces(boardHistory[i + 1]);
-            
-            if (piecesBefore > piecesAfter) {
-                break; // Found capture, reset counter
-            }
-        }        
-        // Handle castling properly - count as one move, not two
-        // When going backwards through move history, castling appears as:
-        // - Rook move (at higher index, encountered first when going backwards)
-        // - King move (at lower index, encountered second when going backwards)
-        
-        if (isKingCastlingMove(i - 1)) {
-            movesSinceLastPawnMoveOrCapture++;
-            i--; // Skip the rook move that follows castling
-        } else {
-            movesSinceLastPawnMoveOrCapture++;
-        }
-        
-        // If we've counted 100 half-moves (50 full moves) without finding a pawn move or capture,
-        // it's a draw by fifty-move rule
-        if (movesSinceLastPawnMoveOrCapture >= 100) {
-            return true;
-        }
-    }
-    
-    return false;
+    // 50 moves by each side = 100 player moves without a pawn move or capture.
+    // Castling counts as one move.
+    return !stateHistory.empty() && stateHistory.back().rule50 >= 100;
 }
 
 bool Board::isDrawByInsufficientMaterial() const {
@@ -510,15 +646,22 @@ bool Board::isOccupiedByWhite(const std::pair<int, int>& pos) const {
 
 void Board::placePiece(Piece* piece, const std::pair<int, int>& pos) {
     board[pos.second][pos.first] = piece;
+    targetCacheFilled = 0;
+    compactCacheValid = false;
 }
 
 void Board::removePiece(const std::pair<int, int>& pos) {
     board[pos.second][pos.first] = nullptr;
+    targetCacheFilled = 0;
+    compactCacheValid = false;
 }
 
-void Board::movePiece(const std::pair<int, int>& from, const std::pair<int, int>& to) {
+void Board::movePiece(const std::pair<int, int>& from, const std::pair<int, int>& to, char promotion) {
     if (isLegal(from, to)) {
+        targetCacheFilled = 0;
+        compactCacheValid = false;
         Piece* piece = board[from.second][from.first];
+        int promotedTo = 0; // PieceIndex of the promotion piece, for the game log
         
         // Check if this is a castling move
         if (dynamic_cast<King*>(piece) && abs(to.first - from.first) == 2) {
@@ -537,8 +680,8 @@ void Board::movePiece(const std::pair<int, int>& from, const std::pair<int, int>
             board[to.second][to.first] = piece;
             board[from.second][from.first] = nullptr;
               // Record both moves in history
-            moveHistory.push_back({from, to, piece});
-            moveHistory.push_back({{rookFromX, row}, {rookToX, row}, rook});
+            recordMove({from, to, piece});
+            recordMove({{rookFromX, row}, {rookToX, row}, rook});
             
             // Save board state after castling
             saveBoardState();
@@ -548,22 +691,9 @@ void Board::movePiece(const std::pair<int, int>& from, const std::pair<int, int>
             std::pair<int, int> capturedPawnPos = {-1, -1};
             
             if (dynamic_cast<Pawn*>(piece)) {
-                // Check if this is an en passant capture
-                if ((to.first == from.first + 1 || to.first == from.first - 1) &&
-                    to.second == from.second + (piece->white ? 1 : -1) &&
-                    !isOccupied(to)) {
-                    
-                    // Check if the last move was a pawn moving two squares
-                    if (!moveHistory.empty()) {
-                        const Move& lastMove = moveHistory.back();
-                        if (dynamic_cast<Pawn*>(lastMove.piece) &&
-                            lastMove.from == std::make_pair(to.first, to.second + (piece->white ? 1 : -1)) &&
-                            lastMove.to == std::make_pair(to.first, to.second - (piece->white ? 1 : -1))) {
-                            isEnPassant = true;
-                            capturedPawnPos = {to.first, to.second - (piece->white ? 1 : -1)};
-                        }
-                    }
-                }
+                isEnPassant = piece->white ? isEnPassantCapture<Color::White>(from, to)
+                                           : isEnPassantCapture<Color::Black>(from, to);
+                capturedPawnPos = {to.first, from.second};
             }
             
             // Regular move or en passant
@@ -573,26 +703,81 @@ void Board::movePiece(const std::pair<int, int>& from, const std::pair<int, int>
             }
             board[to.second][to.first] = piece;
             board[from.second][from.first] = nullptr;
-            moveHistory.push_back({from, to, piece});
+            recordMove({from, to, piece});
             
             // Check for pawn promotion
             if (dynamic_cast<Pawn*>(piece)) {
                 // White pawn reaches rank 8 (index 7) or black pawn reaches rank 1 (index 0)
-                if ((piece->white && to.second == 7) || (!piece->white && to.second == 0)) {
-                    // For now, auto-promote to Queen. In a real game, player would choose.
-                    promotePawn(to, 'Q');
-                    std::cout << "Pawn promoted to Queen!" << std::endl;
+                if (to.second == (piece->white ? ColorTraits<Color::White>::promotionRank
+                                               : ColorTraits<Color::Black>::promotionRank)) {
+                    // Queen unless the caller chose another piece
+                    promotePawn(to, promotion);
+                    promotedTo = (promotion == 'R' || promotion == 'r') ? ROOK
+                               : (promotion == 'B' || promotion == 'b') ? BISHOP
+                               : (promotion == 'N' || promotion == 'n') ? KNIGHT : QUEEN;
+                    if (consoleMessages) {
+                        const char* name = promotedTo == ROOK ? "Rook" : promotedTo == BISHOP ? "Bishop"
+                                         : promotedTo == KNIGHT ? "Knight" : "Queen";
+                        std::cout << "Pawn promoted to " << name << "!" << std::endl;
+                    }
                 }
             }
             
             // Save board state after regular move or en passant
             saveBoardState();
         }
-    } else {
+        if (keepGameLog) {
+            gameLog.push_back(packMove(from.first + 8 * from.second, to.first + 8 * to.second, promotedTo));
+        }
+    } else if (consoleMessages) {
         std::cout << "Invalid move." << std::endl;    
     }
 }
 
+void Board::recordMove(const Move& move) {
+    if (historyMode == HistoryMode::Full) {
+        moveHistory.push_back(move);
+    }
+    lastMoveRecord = move;
+    hasLastMove = true;
+    if (!hasPieceMoved(move.piece)) {
+        movedPieces.push_back(move.piece);
+    }
+}
+
+const Board::Move* Board::lastMove() const {
+    // Kept in every mode, so it survives moveHistory being dropped by a switch to Bounded
+    return hasLastMove ? &lastMoveRecord : nullptr;
+}
+
+void Board::setHistoryMode(HistoryMode mode) {
+    if (mode == HistoryMode::Bounded) {
+        // Draw detection only needs the recent stateHistory from here on
+        std::vector<Move>().swap(moveHistory);
+        std::vector<BoardState>().swap(boardHistory);
+        if ((int)stateHistory.size() > BOUNDED_STATES) {
+            stateHistory.erase(stateHistory.begin(), stateHistory.end() - BOUNDED_STATES);
+        }
+    }
+    historyMode = mode;
+}
+
+template <Color C>
+bool Board::isEnPassantCapture(const std::pair<int, int>& from, const std::pair<int, int>& to) const {
+    constexpr int forward = ColorTraits<C>::forward;
+    // Diagonal step onto an empty square
+    if ((to.first != from.first + 1 && to.first != from.first - 1) ||
+        to.second != from.second + forward || isOccupied(to)) {
+        return false;
+    }
+    
+    // Check if the last move was a pawn moving two squares past the target
+    const Move* last = lastMove();
+    return last != nullptr && dynamic_cast<Pawn*>(last->piece) &&
+           last->from == std::make_pair(to.first, to.second + forward) &&
+           last->to == std::make_pair(to.first, to.second - forward);
+}
+
 void Board::promotePawn(const std::pair<int, int>& pos, char pieceType) {
     Piece* pawn = board[pos.second][pos.first];
     if (pawn && dynamic_cast<Pawn*>(pawn)) {
@@ -619,6 +804,8 @@ void Board::promotePawn(const std::pair<int, int>& pos, char pieceType) {
         }
         
         board[pos.second][pos.first] = newPiece;
+        targetCacheFilled = 0;
+        compactCacheValid = false;
     }
 }
 
@@ -641,6 +828,13 @@ bool Piece::canMoveTo(const Board* board, const std::pair<int, int>& to) {
 
 // Pawn method implementation
 bool Pawn::canMoveTo(const Board* board, const std::pair<int, int>& to) {
+    return white ? canMoveToAs<Color::White>(board, to) : canMoveToAs<Color::Black>(board, to);
+}
+
+template <Color C>
+bool Pawn::canMoveToAs(const Board* board, const std::pair<int, int>& to) {
+    constexpr bool white = ColorTraits<C>::white;
+    constexpr int forward = ColorTraits<C>::forward;
     if(to.first < 0 || to.first > 7 || to.second < 0 || to.second > 7) {
         return false; 
     }
@@ -650,27 +844,28 @@ bool Pawn::canMoveTo(const Board* board, const std::pair<int, int>& to) {
     }
     // Pawn forward move
     if(currentPos.first == to.first) {
-        if(to.second == currentPos.second + (white ? 1 : -1)) {
+        if(to.second == currentPos.second + forward) {
             if (!board->isOccupied(to)) {
                 return true;
             }
         }
-        if (to.second == currentPos.second + (white ? 2 : -2) && currentPos.second == (white ? 1 : 6)) {
-            if (!board->isOccupied(to) && !board->isOccupied({currentPos.first, currentPos.second + (white ? 1 : -1)})) {
+        if (to.second == currentPos.second + 2 * forward && currentPos.second == ColorTraits<C>::pawnStartRank) {
+            if (!board->isOccupied(to) && !board->isOccupied({currentPos.first, currentPos.second + forward})) {
                 return true;
             }
         }
     }
     // Pawn capture
     if ((to.first == currentPos.first + 1 || to.first == currentPos.first - 1) &&
-        to.second == currentPos.second + (white ? 1 : -1)) {
+        to.second == currentPos.second + forward) {
         if (board->isOccupied(to) && board->isOccupiedByWhite(to) != white) {
             return true;
         }
         //En passant
-        if (dynamic_cast<Pawn*> (board->moveHistory.back().piece)&&
-            board->moveHistory.back().from == std::make_pair(to.first, to.second + (white ? 1 : -1)) &&
-            board->moveHistory.back().to == std::make_pair(to.first, to.second - (white ? 1 : -1))){
+        const Board::Move* lastMove = board->lastMove();
+        if (lastMove != nullptr && dynamic_cast<Pawn*> (lastMove->piece)&&
+            lastMove->from == std::make_pair(to.first, to.second + forward) &&
+            lastMove->to == std::make_pair(to.first, to.second - forward)){
             return true;
         }
     }
@@ -776,6 +971,12 @@ bool Queen::canMoveTo(const Board* board, const std::pair<int, int>& to) {
 
 // King method implementation
 bool King::canMoveTo(const Board* board, const std::pair<int, int>& to) {
+    return white ? canMoveToAs<Color::White>(board, to) : canMoveToAs<Color::Black>(board, to);
+}
+
+template <Color C>
+bool King::canMoveToAs(const Board* board, const std::pair<int, int>& to) {
+    constexpr bool white = ColorTraits<C>::white;
     if(to.first < 0 || to.first > 7 || to.second < 0 || to.second > 7) {
         return false; 
     }
@@ -796,7 +997,7 @@ bool King::canMoveTo(const Board* board, const std::pair<int, int>& to) {
     // Castling logic
     if (currentPos.second == to.second && abs(to.first - currentPos.first) == 2) {
         // Check if king is on starting position
-        int kingStartRow = white ? 0 : 7;
+        constexpr int kingStartRow = ColorTraits<C>::homeRank;
         if (currentPos.second != kingStartRow || currentPos.first != 4) {
             return false; // King not on starting position
         }
@@ -807,7 +1008,7 @@ bool King::canMoveTo(const Board* board, const std::pair<int, int>& to) {
         }
         
         // Check if king is in check
-        if (board->isCheck(white)) {
+        if (board->isCheck<C>()) {
             return false; // Cannot castle while in check
         }
         
@@ -843,7 +1044,7 @@ bool King::canMoveTo(const Board* board, const std::pair<int, int>& to) {
             const_cast<Board*>(board)->board[currentPos.second][currentPos.first] = nullptr;
             const_cast<Board*>(board)->board[intermediatePos.second][intermediatePos.first] = const_cast<King*>(this);
             
-            bool inCheck = board->isCheck(white);
+            bool inCheck = board->isCheck<C>();
             
             // Restore king position
             const_cast<Board*>(board)->board[intermediatePos.second][intermediatePos.first] = nullptr;
@@ -860,8 +1061,58 @@ bool King::canMoveTo(const Board* board, const std::pair<int, int>& to) {
     return false;
 }
 
+static int countPieces(const Board::BoardState& state) {
+    int count = 0;
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            if (state.board[y][x] != nullptr) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
 void Board::saveBoardState() {
-    boardHistory.push_back(getCurrentBoardState());
+    compactCacheValid = false;
+    BoardState state = getCurrentBoardState();
+    
+    // Side to move alternates from white at the first saved state
+    StateInfo info;
+    info.key = positionKey(state, savedStates % 2 == 0);
+    info.rule50 = 0;
+    info.repetition = 0;
+    info.pieceCount = countPieces(state);
+    if (!stateHistory.empty() && lastMove() != nullptr) {
+        bool pawnMove = dynamic_cast<Pawn*>(lastMove()->piece) != nullptr;
+        bool capture = stateHistory.back().pieceCount > info.pieceCount;
+        if (!pawnMove && !capture) {
+            info.rule50 = stateHistory.back().rule50 + 1;
+        }
+    }
+    if (info.rule50 == 0) {
+        stateHistory.clear(); // Earlier positions can never repeat
+    }
+    
+    // Look for the same position with the same side to move since the last irreversible move
+    int end = std::min(info.rule50, (int)stateHistory.size());
+    for (int i = 4; i <= end; i += 2) {
+        const StateInfo& previous = stateHistory[stateHistory.size() - i];
+        if (previous.key == info.key) {
+            info.repetition = previous.repetition ? -i : i;
+            break;
+        }
+    }
+    
+    if (historyMode == HistoryMode::Full) {
+        boardHistory.push_back(state);
+    }
+    stateHistory.push_back(info);
+    if (historyMode == HistoryMode::Bounded && (int)stateHistory.size() > BOUNDED_STATES) {
+        // Only reached after more than 127 reversible plies in a row
+        stateHistory.erase(stateHistory.begin(), stateHistory.end() - BOUNDED_STATES);
+    }
+    savedStates++;
 }
 
 Board::BoardState Board::getCurrentBoardState() const {
@@ -903,16 +1154,15 @@ Board::BoardState Board::getCurrentBoardState() const {
     // Determine en passant target square
     state.enPassantTarget = {-1, -1}; // Default: no en passant
     
-    if (!moveHistory.empty()) {
-        const Move& lastMove = moveHistory.back();
-        
+    const Move* last = lastMove();
+    if (last != nullptr) {
         // Check if last move was a pawn moving two squares
-        if (dynamic_cast<Pawn*>(lastMove.piece) && 
-            abs(lastMove.to.second - lastMove.from.second) == 2) {
+        if (dynamic_cast<Pawn*>(last->piece) && 
+            abs(last->to.second - last->from.second) == 2) {
             
             // En passant target is the square the pawn passed over
-            int targetY = (lastMove.from.second + lastMove.to.second) / 2;
-            state.enPassantTarget = {lastMove.to.first, targetY};
+            int targetY = (last->from.second + last->to.second) / 2;
+            state.enPassantTarget = {last->to.first, targetY};
         }
     }
     
@@ -922,4 +1172,1248 @@ Board::BoardState Board::getCurrentBoardState() const {
 void Board::initializeBoardHistory() {
     // Save the initial board state (should be called after setting up starting position)
     saveBoardState();
-}
\ No newline at end of file
+}
+// Bitboard helpers. The templates take a plain uint64_t for a single position or one of the
+// SIMD lane types below, which hold the same bitboard for several positions side by side.
+constexpr uint64_t ALL_SQUARES = ~0ULL;
+constexpr uint64_t FILE_A = 0x0101010101010101ULL;
+constexpr uint64_t FILE_H = FILE_A << 7;
+constexpr uint64_t NOT_FILE_A = ~FILE_A;
+constexpr uint64_t NOT_FILE_H = ~FILE_H;
+constexpr uint64_t RANK_1 = 0xFFULL;
+constexpr uint64_t RANK_3 = RANK_1 << 16;
+constexpr uint64_t RANK_6 = RANK_1 << 40;
+constexpr uint64_t RANK_8 = RANK_1 << 56;
+
+template <int Shift, class B>
+inline B shiftBits(B b) {
+    if constexpr (Shift > 0) {
+        return b << Shift;
+    } else {
+        return b >> -Shift;
+    }
+}
+
+// Squares reached by sliding from every bit of gen in one direction until blocked (Kogge-Stone fill)
+template <int Shift, class B>
+inline B slideAttacks(B gen, B empty, uint64_t wrap) {
+    B pro = empty & wrap;
+    gen = gen | (pro & shiftBits<Shift>(gen));
+    pro = pro & shiftBits<Shift>(pro);
+    gen = gen | (pro & shiftBits<2 * Shift>(gen));
+    pro = pro & shiftBits<2 * Shift>(pro);
+    gen = gen | (pro & shiftBits<4 * Shift>(gen));
+    return shiftBits<Shift>(gen) & wrap;
+}
+
+template <class B>
+inline B diagonalAttacks(B sliders, B empty) {
+    return slideAttacks<9>(sliders, empty, NOT_FILE_A) | slideAttacks<7>(sliders, empty, NOT_FILE_H) |
+           slideAttacks<-7>(sliders, empty, NOT_FILE_A) | slideAttacks<-9>(sliders, empty, NOT_FILE_H);
+}
+
+template <class B>
+inline B orthogonalAttacks(B sliders, B empty) {
+    return slideAttacks<8>(sliders, empty, ALL_SQUARES) | slideAttacks<-8>(sliders, empty, ALL_SQUARES) |
+           slideAttacks<1>(sliders, empty, NOT_FILE_A) | slideAttacks<-1>(sliders, empty, NOT_FILE_H);
+}
+
+template <class B>
+inline B knightAttacks(B b) {
+    B l1 = (b >> 1) & 0x7F7F7F7F7F7F7F7FULL;
+    B l2 = (b >> 2) & 0x3F3F3F3F3F3F3F3FULL;
+    B r1 = (b << 1) & 0xFEFEFEFEFEFEFEFEULL;
+    B r2 = (b << 2) & 0xFCFCFCFCFCFCFCFCULL;
+    B h1 = l1 | r1;
+    B h2 = l2 | r2;
+    return (h1 << 16) | (h1 >> 16) | (h2 << 8) | (h2 >> 8);
+}
+
+template <class B>
+inline B kingAttacks(B b) {
+    B sideways = ((b << 1) & NOT_FILE_A) | ((b >> 1) & NOT_FILE_H);
+    B row = b | sideways;
+    return sideways | (row << 8) | (row >> 8);
+}
+
+// Squares attacked by pawns of colour C
+template <Color C, class B>
+inline B pawnAttacks(B b) {
+    constexpr int forward = 8 * ColorTraits<C>::forward;
+    return (shiftBits<forward + 1>(b) & NOT_FILE_A) | (shiftBits<forward - 1>(b) & NOT_FILE_H);
+}
+
+// Per-lane predicates return all ones for true and zero for false so they can be used as masks
+inline uint64_t lanesZero(uint64_t b) { return b ? 0 : ~0ULL; }
+inline uint64_t lanesBit(uint64_t square) { return 1ULL << square; }
+
+template <class B>
+inline B lanesNonZero(B b) { return ~lanesZero(b); }
+
+template <class B>
+inline B lanesEqual(B a, B b) { return lanesZero(a ^ b); }
+
+template <class B>
+inline B lanesSelect(B mask, B a, B b) { return (a & mask) | (b & ~mask); }
+
+template <class B> B lanesLoad(const uint64_t* p);
+template <class B> B lanesLoadSquares(const uint8_t* p);
+
+template <> inline uint64_t lanesLoad<uint64_t>(const uint64_t* p) { return *p; }
+template <> inline uint64_t lanesLoadSquares<uint64_t>(const uint8_t* p) { return *p; }
+inline void lanesStore(uint8_t* out, uint64_t mask) { *out = mask != 0; }
+
+#if defined(__AVX2__)
+// Four positions per instruction
+struct Lanes4 {
+    __m256i v;
+    Lanes4() = default;
+    Lanes4(__m256i x) : v(x) {}
+    Lanes4(uint64_t x) : v(_mm256_set1_epi64x((long long)x)) {}
+    friend Lanes4 operator&(Lanes4 a, Lanes4 b) { return _mm256_and_si256(a.v, b.v); }
+    friend Lanes4 operator|(Lanes4 a, Lanes4 b) { return _mm256_or_si256(a.v, b.v); }
+    friend Lanes4 operator^(Lanes4 a, Lanes4 b) { return _mm256_xor_si256(a.v, b.v); }
+    Lanes4 operator~() const { return _mm256_xor_si256(v, _mm256_set1_epi64x(-1)); }
+    Lanes4 operator<<(int n) const { return _mm256_slli_epi64(v, n); }
+    Lanes4 operator>>(int n) const { return _mm256_srli_epi64(v, n); }
+};
+
+inline Lanes4 lanesZero(Lanes4 b) { return _mm256_cmpeq_epi64(b.v, _mm256_setzero_si256()); }
+inline Lanes4 lanesBit(Lanes4 square) { return _mm256_sllv_epi64(_mm256_set1_epi64x(1), square.v); }
+inline Lanes4 lanesSelect(Lanes4 mask, Lanes4 a, Lanes4 b) { return _mm256_blendv_epi8(b.v, a.v, mask.v); }
+
+template <> inline Lanes4 lanesLoad<Lanes4>(const uint64_t* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+template <> inline Lanes4 lanesLoadSquares<Lanes4>(const uint8_t* p) {
+    int32_t packed;
+    memcpy(&packed, p, sizeof(packed));
+    return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+}
+inline void lanesStore(uint8_t* out, Lanes4 mask) {
+    int bits = _mm256_movemask_pd(_mm256_castsi256_pd(mask.v));
+    for (int lane = 0; lane < 4; lane++) {
+        out[lane] = (bits >> lane) & 1;
+    }
+}
+#endif
+
+#if defined(__AVX512F__)
+// Eight positions per instruction
+struct Lanes8 {
+    __m512i v;
+    Lanes8() = default;
+    Lanes8(__m512i x) : v(x) {}
+    Lanes8(uint64_t x) : v(_mm512_set1_epi64((long long)x)) {}
+    friend Lanes8 operator&(Lanes8 a, Lanes8 b) { return _mm512_and_si512(a.v, b.v); }
+    friend Lanes8 operator|(Lanes8 a, Lanes8 b) { return _mm512_or_si512(a.v, b.v); }
+    friend Lanes8 operator^(Lanes8 a, Lanes8 b) { return _mm512_xor_si512(a.v, b.v); }
+    Lanes8 operator~() const { return _mm512_ternarylogic_epi64(v, v, v, 0x55); }
+    Lanes8 operator<<(int n) const { return _mm512_slli_epi64(v, n); }
+    Lanes8 operator>>(int n) const { return _mm512_srli_epi64(v, n); }
+};
+
+inline Lanes8 lanesZero(Lanes8 b) {
+    return _mm512_maskz_set1_epi64(_mm512_testn_epi64_mask(b.v, b.v), -1);
+}
+inline Lanes8 lanesBit(Lanes8 square) { return _mm512_sllv_epi64(_mm512_set1_epi64(1), square.v); }
+inline Lanes8 lanesSelect(Lanes8 mask, Lanes8 a, Lanes8 b) {
+    return _mm512_ternarylogic_epi64(mask.v, a.v, b.v, 0xCA);
+}
+
+template <> inline Lanes8 lanesLoad<Lanes8>(const uint64_t* p) { return _mm512_loadu_si512(p); }
+template <> inline Lanes8 lanesLoadSquares<Lanes8>(const uint8_t* p) {
+    return _mm512_cvtepu8_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+}
+inline void lanesStore(uint8_t* out, Lanes8 mask) {
+    __mmask8 bits = _mm512_test_epi64_mask(mask.v, mask.v);
+    for (int lane = 0; lane < 8; lane++) {
+        out[lane] = (bits >> lane) & 1;
+    }
+}
+#endif
+
+static int pieceIndexOf(const Piece* piece) {
+    if (dynamic_cast<const Pawn*>(piece)) return PAWN;
+    if (dynamic_cast<const Knight*>(piece)) return KNIGHT;
+    if (dynamic_cast<const Bishop*>(piece)) return BISHOP;
+    if (dynamic_cast<const Rook*>(piece)) return ROOK;
+    if (dynamic_cast<const Queen*>(piece)) return QUEEN;
+    return KING;
+}
+
+void Board::PositionBatch::append(const CompactPosition& position, uint16_t move) {
+    for (int color = 0; color < 2; color++) {
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            pieces[color][type].push_back(position.pieces(color, type));
+        }
+    }
+    uint64_t castling = 0;
+    if (position.castling & 1) castling |= 1ULL << 6;
+    if (position.castling & 2) castling |= 1ULL << 2;
+    if (position.castling & 4) castling |= 1ULL << 62;
+    if (position.castling & 8) castling |= 1ULL << 58;
+    castlingTargets.push_back(castling);
+    enPassant.push_back(position.enPassant == -1 ? 0 : 1ULL << position.enPassant);
+    from.push_back(moveFrom(move));
+    to.push_back(moveTo(move));
+}
+
+void Board::PositionBatch::clear() {
+    for (int color = 0; color < 2; color++) {
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            pieces[color][type].clear();
+        }
+    }
+    castlingTargets.clear();
+    enPassant.clear();
+    from.clear();
+    to.clear();
+}
+
+void Board::appendToBatch(PositionBatch& batch, const std::pair<int, int>& from, const std::pair<int, int>& to) const {
+    // Off-board moves become a1-a1, which is never legal
+    bool inBounds = from.first >= 0 && from.first <= 7 && from.second >= 0 && from.second <= 7 &&
+                    to.first >= 0 && to.first <= 7 && to.second >= 0 && to.second <= 7;
+    batch.append(compactPosition(), inBounds ? packMove(from.first + 8 * from.second, to.first + 8 * to.second) : 0);
+}
+
+// Legality of the candidate move in positions i .. i + width - 1, as a lane mask.
+// Same rules as Board::isLegal: the colour of the moving piece decides the side to move.
+template <class B>
+static B legalityLanes(const Board::PositionBatch& batch, size_t i) {
+    B fromBit = lanesBit(lanesLoadSquares<B>(&batch.from[i]));
+    B toBit = lanesBit(lanesLoadSquares<B>(&batch.to[i]));
+    
+    B white[PIECE_TYPES], black[PIECE_TYPES];
+    B whiteAll(0ULL), blackAll(0ULL);
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        white[type] = lanesLoad<B>(&batch.pieces[0][type][i]);
+        black[type] = lanesLoad<B>(&batch.pieces[1][type][i]);
+        whiteAll = whiteAll | white[type];
+        blackAll = blackAll | black[type];
+    }
+    B weAreWhite = lanesNonZero(whiteAll & fromBit);
+    B ours[PIECE_TYPES], theirs[PIECE_TYPES];
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        ours[type] = lanesSelect(weAreWhite, white[type], black[type]);
+        theirs[type] = lanesSelect(weAreWhite, black[type], white[type]);
+    }
+    B us = lanesSelect(weAreWhite, whiteAll, blackAll);
+    B them = lanesSelect(weAreWhite, blackAll, whiteAll);
+    B occupied = us | them;
+    B empty = ~occupied;
+    B enPassant = lanesLoad<B>(&batch.enPassant[i]);
+    B castling = lanesSelect(weAreWhite, lanesLoad<B>(&batch.castlingTargets[i]) & RANK_1,
+                             lanesLoad<B>(&batch.castlingTargets[i]) & RANK_8);
+    
+    B isPawn = lanesNonZero(ours[PAWN] & fromBit);
+    B isKnight = lanesNonZero(ours[KNIGHT] & fromBit);
+    B isBishop = lanesNonZero(ours[BISHOP] & fromBit);
+    B isRook = lanesNonZero(ours[ROOK] & fromBit);
+    B isQueen = lanesNonZero(ours[QUEEN] & fromBit);
+    B isKing = lanesNonZero(ours[KING] & fromBit);
+    
+    // Destinations the piece on from can reach, ignoring checks
+    B forwardOne = lanesSelect(weAreWhite, fromBit << 8, fromBit >> 8) & empty;
+    B forwardTwo = lanesSelect(weAreWhite, (forwardOne & RANK_3) << 8, (forwardOne & RANK_6) >> 8) & empty;
+    B epVictim = lanesSelect(weAreWhite, enPassant >> 8, enPassant << 8) & theirs[PAWN];
+    B epTarget = enPassant & lanesNonZero(epVictim);
+    B pawnTargets = forwardOne | forwardTwo |
+                    (lanesSelect(weAreWhite, pawnAttacks<Color::White>(fromBit), pawnAttacks<Color::Black>(fromBit)) & (them | epTarget));
+    B targets = (pawnTargets & isPawn) | (knightAttacks(fromBit) & isKnight) |
+                (diagonalAttacks(fromBit, empty) & (isBishop | isQueen)) |
+                (orthogonalAttacks(fromBit, empty) & (isRook | isQueen)) |
+                (kingAttacks(fromBit) & isKing);
+    targets = targets & ~us;
+    
+    // Squares attacked by the opponent once the move is made
+    B captured = toBit | (epVictim & isPawn & lanesEqual(toBit, epTarget));
+    B emptyAfter = ~((occupied & ~fromBit & ~captured) | toBit);
+    B kingAfter = lanesSelect(isKing, toBit, ours[KING]);
+    B theirPawns = theirs[PAWN] & ~captured;
+    B attacked = lanesSelect(weAreWhite, pawnAttacks<Color::Black>(theirPawns), pawnAttacks<Color::White>(theirPawns)) |
+                 knightAttacks(theirs[KNIGHT] & ~captured) | kingAttacks(theirs[KING]) |
+                 diagonalAttacks((theirs[BISHOP] | theirs[QUEEN]) & ~captured, emptyAfter) |
+                 orthogonalAttacks((theirs[ROOK] | theirs[QUEEN]) & ~captured, emptyAfter);
+    
+    // Castling: right still held, rook in place, path empty, king never crosses an attacked square.
+    // The king has already left from in emptyAfter, which cannot hide an attack on the crossed squares.
+    B kingside = lanesEqual(toBit, fromBit << 2) & lanesNonZero(ours[ROOK] & (fromBit << 3)) &
+                 lanesZero(occupied & ((fromBit << 1) | (fromBit << 2))) &
+                 lanesZero(attacked & (fromBit | (fromBit << 1) | (fromBit << 2)));
+    B queenside = lanesEqual(toBit, fromBit >> 2) & lanesNonZero(ours[ROOK] & (fromBit >> 4)) &
+                  lanesZero(occupied & ((fromBit >> 1) | (fromBit >> 2) | (fromBit >> 3))) &
+                  lanesZero(attacked & (fromBit | (fromBit >> 1) | (fromBit >> 2)));
+    B castles = isKing & lanesNonZero(toBit & castling) & (kingside | queenside);
+    
+    return lanesNonZero(us & fromBit) & (lanesNonZero(targets & toBit) | castles) & lanesZero(attacked & kingAfter);
+}
+
+void Board::isLegalBatch(const PositionBatch& batch, std::vector<uint8_t>& legal) {
+    size_t count = batch.size();
+    legal.resize(count);
+    size_t i = 0;
+#if defined(__AVX512F__)
+    for (; i + 8 <= count; i += 8) {
+        lanesStore(&legal[i], legalityLanes<Lanes8>(batch, i));
+    }
+#elif defined(__AVX2__)
+    for (; i + 4 <= count; i += 4) {
+        lanesStore(&legal[i], legalityLanes<Lanes4>(batch, i));
+    }
+#endif
+    // Scalar fallback for the remainder, or for everything without AVX2
+    for (; i < count; i++) {
+        lanesStore(&legal[i], legalityLanes<uint64_t>(batch, i));
+    }
+}
+
+// Zobrist keys, plus cuckoo tables holding the key change of every reversible piece move
+// (Marcel van Kervinck's cycle detection), used by Board::hasUpcomingRepetition.
+struct Zobrist {
+    uint64_t pieces[2][PIECE_TYPES][64];
+    uint64_t castling[4]; // White kingside, white queenside, black kingside, black queenside
+    uint64_t enPassantFile[8];
+    uint64_t side; // Black to move
+    static const int CUCKOO_SIZE = 8192;
+    uint64_t cuckooKeys[CUCKOO_SIZE];
+    uint8_t cuckooFrom[CUCKOO_SIZE];
+    uint8_t cuckooTo[CUCKOO_SIZE];
+    
+    static int cuckooHash1(uint64_t key) { return key & (CUCKOO_SIZE - 1); }
+    static int cuckooHash2(uint64_t key) { return (key >> 16) & (CUCKOO_SIZE - 1); }
+    
+    Zobrist() {
+        uint64_t seed = 1070372;
+        auto next = [&seed]() {
+            seed ^= seed >> 12;
+            seed ^= seed << 25;
+            seed ^= seed >> 27;
+            return seed * 2685821657736338717ULL;
+        };
+        for (int color = 0; color < 2; color++) {
+            for (int type = 0; type < PIECE_TYPES; type++) {
+                for (int square = 0; square < 64; square++) {
+                    pieces[color][type][square] = next();
+                }
+            }
+        }
+        for (uint64_t& key : castling) key = next();
+        for (uint64_t& key : enPassantFile) key = next();
+        side = next();
+        
+        memset(cuckooKeys, 0, sizeof(cuckooKeys));
+        memset(cuckooFrom, 0, sizeof(cuckooFrom));
+        memset(cuckooTo, 0, sizeof(cuckooTo));
+        for (int color = 0; color < 2; color++) {
+            for (int type = KNIGHT; type <= KING; type++) {
+                for (int s1 = 0; s1 < 64; s1++) {
+                    uint64_t from = 1ULL << s1;
+                    uint64_t reach = type == KNIGHT ? knightAttacks(from)
+                                   : type == BISHOP ? diagonalAttacks(from, ALL_SQUARES)
+                                   : type == ROOK ? orthogonalAttacks(from, ALL_SQUARES)
+                                   : type == QUEEN ? diagonalAttacks(from, ALL_SQUARES) | orthogonalAttacks(from, ALL_SQUARES)
+                                   : kingAttacks(from);
+                    for (int s2 = s1 + 1; s2 < 64; s2++) {
+                        if (reach & (1ULL << s2)) {
+                            insertCuckoo(pieces[color][type][s1] ^ pieces[color][type][s2] ^ side, s1, s2);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    void insertCuckoo(uint64_t key, uint8_t from, uint8_t to) {
+        // Displace entries between their two slots until one lands in an empty slot
+        int i = cuckooHash1(key);
+        while (true) {
+            std::swap(cuckooKeys[i], key);
+            std::swap(cuckooFrom[i], from);
+            std::swap(cuckooTo[i], to);
+            if (key == 0) {
+                return;
+            }
+            i = (i == cuckooHash1(key)) ? cuckooHash2(key) : cuckooHash1(key);
+        }
+    }
+};
+
+static const Zobrist& zobrist() {
+    static const Zobrist keys;
+    return keys;
+}
+
+uint64_t Board::positionKey(const BoardState& state, bool whiteToMove) const {
+    const Zobrist& z = zobrist();
+    uint64_t key = whiteToMove ? 0 : z.side;
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            Piece* piece = state.board[y][x];
+            if (piece != nullptr) {
+                key ^= z.pieces[piece->white ? 0 : 1][pieceIndexOf(piece)][x + 8 * y];
+            }
+        }
+    }
+    if (state.whiteCanCastleKingside) key ^= z.castling[0];
+    if (state.whiteCanCastleQueenside) key ^= z.castling[1];
+    if (state.blackCanCastleKingside) key ^= z.castling[2];
+    if (state.blackCanCastleQueenside) key ^= z.castling[3];
+    if (state.enPassantTarget.first != -1) {
+        key ^= z.enPassantFile[state.enPassantTarget.first];
+    }
+    return key;
+}
+
+// ply is the number of moves made since the search root; at or before the root only a
+// move that completes a threefold repetition counts.
+bool Board::hasUpcomingRepetition(int ply) const {
+    if (stateHistory.empty()) {
+        return false;
+    }
+    const Zobrist& z = zobrist();
+    int current = stateHistory.size() - 1;
+    int end = std::min(stateHistory[current].rule50, current);
+    if (end < 3) {
+        return false;
+    }
+    
+    uint64_t originalKey = stateHistory[current].key;
+    // XOR of the opponent's key changes; zero once the opponent has undone its own moves
+    uint64_t other = originalKey ^ stateHistory[current - 1].key ^ z.side;
+    for (int i = 3; i <= end; i += 2) {
+        other ^= stateHistory[current - i + 1].key ^ stateHistory[current - i].key ^ z.side;
+        if (other != 0) {
+            continue;
+        }
+        
+        // One reversible move of ours would turn the current position into position current - i
+        uint64_t moveKey = originalKey ^ stateHistory[current - i].key;
+        int j = Zobrist::cuckooHash1(moveKey);
+        if (z.cuckooKeys[j] != moveKey) {
+            j = Zobrist::cuckooHash2(moveKey);
+            if (z.cuckooKeys[j] != moveKey) {
+                continue;
+            }
+        }
+        
+        // The squares between the two ends of the move must be empty
+        int fromX = z.cuckooFrom[j] % 8, fromY = z.cuckooFrom[j] / 8;
+        int toX = z.cuckooTo[j] % 8, toY = z.cuckooTo[j] / 8;
+        bool pathClear = true;
+        if (fromX == toX || fromY == toY || abs(toX - fromX) == abs(toY - fromY)) {
+            int xStep = (toX > fromX) - (toX < fromX);
+            int yStep = (toY > fromY) - (toY < fromY);
+            for (int x = fromX + xStep, y = fromY + yStep; x != toX || y != toY; x += xStep, y += yStep) {
+                if (board[y][x] != nullptr) {
+                    pathClear = false;
+                    break;
+                }
+            }
+        }
+        if (pathClear && (ply > i || stateHistory[current - i].repetition != 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Two-fold repetition counts as a draw when the earlier occurrence lies inside the search
+// path; positions from the game history still need to have occurred three times.
+bool Board::isDrawInSearch(int ply) const {
+    if (stateHistory.empty()) {
+        return false;
+    }
+    const StateInfo& current = stateHistory.back();
+    if (current.rule50 >= 100) {
+        // Checkmate on the hundredth player move still ends the game as a win
+        CompactPosition position = compactPosition();
+        return !position.inCheck() || position.hasLegalMove();
+    }
+    return current.repetition != 0 && current.repetition < ply;
+}
+
+CompactPosition CompactPosition::startPosition() {
+    CompactPosition position = {};
+    position.byType[PAWN] = (RANK_1 << 8) | (RANK_1 << 48);
+    position.byType[KNIGHT] = 0x4200000000000042ULL;
+    position.byType[BISHOP] = 0x2400000000000024ULL;
+    position.byType[ROOK] = 0x8100000000000081ULL;
+    position.byType[QUEEN] = 0x0800000000000008ULL;
+    position.byType[KING] = 0x1000000000000010ULL;
+    position.byColor[0] = 0xFFFFULL;
+    position.byColor[1] = 0xFFFFULL << 48;
+    position.castling = 15;
+    position.enPassant = -1;
+    position.whiteToMove = true;
+    position.key = position.computeKey();
+    return position;
+}
+
+uint64_t CompactPosition::computeKey() const {
+    const Zobrist& z = zobrist();
+    uint64_t result = whiteToMove ? 0 : z.side;
+    for (int color = 0; color < 2; color++) {
+        for (int type = 0; type < PIECE_TYPES; type++) {
+            for (uint64_t b = pieces(color, type); b; b &= b - 1) {
+                result ^= z.pieces[color][type][__builtin_ctzll(b)];
+            }
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        if (castling & (1 << i)) {
+            result ^= z.castling[i];
+        }
+    }
+    if (enPassant != -1) {
+        result ^= z.enPassantFile[enPassant % 8];
+    }
+    return result;
+}
+
+int CompactPosition::pieceOn(int square) const {
+    uint64_t bit = 1ULL << square;
+    for (int type = 0; type < PIECE_TYPES; type++) {
+        if (byType[type] & bit) {
+            return type;
+        }
+    }
+    return -1;
+}
+
+template <Color C>
+bool CompactPosition::isAttackedBy(int square) const {
+    constexpr int color = ColorTraits<C>::white ? 0 : 1;
+    uint64_t bit = 1ULL << square;
+    uint64_t empty = ~occupied();
+    // A pawn of colour C attacks square if a pawn of the other colour on square would attack it
+    return (pawnAttacks<ColorTraits<C>::opponent>(bit) & pieces(color, PAWN)) ||
+           (knightAttacks(bit) & pieces(color, KNIGHT)) ||
+           (kingAttacks(bit) & pieces(color, KING)) ||
+           (diagonalAttacks(bit, empty) & byColor[color] & (byType[BISHOP] | byType[QUEEN])) ||
+           (orthogonalAttacks(bit, empty) & byColor[color] & (byType[ROOK] | byType[QUEEN]));
+}
+
+bool CompactPosition::inCheck() const {
+    if (whiteToMove) {
+        return isAttackedBy<Color::Black>(__builtin_ctzll(pieces(0, KING)));
+    }
+    return isAttackedBy<Color::White>(__builtin_ctzll(pieces(1, KING)));
+}
+
+// Moves that obey piece movement, with castling already checked for attacked squares
+// except the destination; leavesKingSafe decides the rest.
+template <Color C>
+int CompactPosition::generatePseudoLegalMovesAs(uint16_t* moves) const {
+    constexpr int us = ColorTraits<C>::white ? 0 : 1;
+    constexpr int forward = 8 * ColorTraits<C>::forward;
+    constexpr int home = 8 * ColorTraits<C>::homeRank;
+    constexpr Color them = ColorTraits<C>::opponent;
+    uint64_t own = byColor[us];
+    uint64_t empty = ~occupied();
+    uint16_t* candidates = moves;
+    int count = 0;
+    auto addTargets = [&](int from, uint64_t targets) {
+        for (; targets; targets &= targets - 1) {
+            candidates[count++] = packMove(from, __builtin_ctzll(targets));
+        }
+    };
+    
+    // Pawns: pushes, captures, en passant and the four promotions
+    uint64_t enPassantBit = enPassant != -1 ? 1ULL << enPassant : 0;
+    for (uint64_t b = pieces(us, PAWN); b; b &= b - 1) {
+        int from = __builtin_ctzll(b);
+        uint64_t bit = 1ULL << from;
+        uint64_t one = shiftBits<forward>(bit) & empty;
+        uint64_t two = shiftBits<forward>(one & (ColorTraits<C>::white ? RANK_3 : RANK_6)) & empty;
+        uint64_t targets = one | two | (pawnAttacks<C>(bit) & (byColor[1 - us] | enPassantBit));
+        for (; targets; targets &= targets - 1) {
+            int to = __builtin_ctzll(targets);
+            if (to / 8 == ColorTraits<C>::promotionRank) {
+                for (int promotion = QUEEN; promotion >= KNIGHT; promotion--) {
+                    candidates[count++] = packMove(from, to, promotion);
+                }
+            } else {
+                candidates[count++] = packMove(from, to);
+            }
+        }
+    }
+    for (uint64_t b = pieces(us, KNIGHT); b; b &= b - 1) {
+        addTargets(__builtin_ctzll(b), knightAttacks(b & -b) & ~own);
+    }
+    for (uint64_t b = pieces(us, BISHOP) | pieces(us, QUEEN); b; b &= b - 1) {
+        addTargets(__builtin_ctzll(b), diagonalAttacks(b & -b, empty) & ~own);
+    }
+    for (uint64_t b = pieces(us, ROOK) | pieces(us, QUEEN); b; b &= b - 1) {
+        addTargets(__builtin_ctzll(b), orthogonalAttacks(b & -b, empty) & ~own);
+    }
+    int kingSquare = __builtin_ctzll(pieces(us, KING));
+    addTargets(kingSquare, kingAttacks(pieces(us, KING)) & ~own);
+    
+    // Castling: the king may not start in or cross check; the destination is checked below
+    constexpr int kingside = ColorTraits<C>::white ? 1 : 4;
+    constexpr int queenside = ColorTraits<C>::white ? 2 : 8;
+    if ((castling & (kingside | queenside)) && !isAttackedBy<them>(home + 4)) {
+        if ((castling & kingside) && (empty & (3ULL << (home + 5))) == (3ULL << (home + 5)) &&
+            !isAttackedBy<them>(home + 5)) {
+            candidates[count++] = packMove(home + 4, home + 6);
+        }
+        if ((castling & queenside) && (empty & (7ULL << (home + 1))) == (7ULL << (home + 1)) &&
+            !isAttackedBy<them>(home + 3)) {
+            candidates[count++] = packMove(home + 4, home + 2);
+        }
+    }
+    
+    return count;
+}
+
+template <Color C>
+bool CompactPosition::leavesKingSafe(uint16_t move) const {
+    constexpr int us = ColorTraits<C>::white ? 0 : 1;
+    CompactPosition next = *this;
+    next.makeMoveAs<C>(move);
+    return !next.isAttackedBy<ColorTraits<C>::opponent>(__builtin_ctzll(next.pieces(us, KING)));
+}
+
+int CompactPosition::generateLegalMoves(uint16_t* moves) const {
+    int count = whiteToMove ? generatePseudoLegalMovesAs<Color::White>(moves)
+                            : generatePseudoLegalMovesAs<Color::Black>(moves);
+    int legal = 0;
+    for (int i = 0; i < count; i++) {
+        if (whiteToMove ? leavesKingSafe<Color::White>(moves[i]) : leavesKingSafe<Color::Black>(moves[i])) {
+            moves[legal++] = moves[i];
+        }
+    }
+    return legal;
+}
+
+bool CompactPosition::hasLegalMove() const {
+    uint16_t moves[MAX_MOVES];
+    int count = whiteToMove ? generatePseudoLegalMovesAs<Color::White>(moves)
+                            : generatePseudoLegalMovesAs<Color::Black>(moves);
+    for (int i = 0; i < count; i++) {
+        if (whiteToMove ? leavesKingSafe<Color::White>(moves[i]) : leavesKingSafe<Color::Black>(moves[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CompactPosition::isLegal(uint16_t move) const {
+    uint16_t moves[MAX_MOVES];
+    int count = whiteToMove ? generatePseudoLegalMovesAs<Color::White>(moves)
+                            : generatePseudoLegalMovesAs<Color::Black>(moves);
+    for (int i = 0; i < count; i++) {
+        if (moves[i] == move) {
+            return whiteToMove ? leavesKingSafe<Color::White>(move) : leavesKingSafe<Color::Black>(move);
+        }
+    }
+    return false;
+}
+
+void CompactPosition::makeMove(uint16_t move) {
+    if (whiteToMove) {
+        makeMoveAs<Color::White>(move);
+    } else {
+        makeMoveAs<Color::Black>(move);
+    }
+}
+
+// Castling rights lost when a piece moves from or to square
+static uint8_t castlingRightsLost(int square) {
+    switch (square) {
+        case 4: return 1 | 2;
+        case 7: return 1;
+        case 0: return 2;
+        case 60: return 4 | 8;
+        case 63: return 4;
+        case 56: return 8;
+        default: return 0;
+    }
+}
+
+template <Color C>
+void CompactPosition::makeMoveAs(uint16_t move) {
+    constexpr int us = ColorTraits<C>::white ? 0 : 1;
+    constexpr int them = 1 - us;
+    constexpr int forward = 8 * ColorTraits<C>::forward;
+    const Zobrist& z = zobrist();
+    int from = moveFrom(move);
+    int to = moveTo(move);
+    uint64_t fromBit = 1ULL << from;
+    uint64_t toBit = 1ULL << to;
+    int type = pieceOn(from);
+    int captured = (byColor[them] & toBit) ? pieceOn(to) : -1;
+    
+    key ^= z.side;
+    int previousEnPassant = enPassant;
+    if (enPassant != -1) {
+        key ^= z.enPassantFile[enPassant % 8];
+        enPassant = -1;
+    }
+    
+    if (captured != -1) {
+        byType[captured] ^= toBit;
+        byColor[them] ^= toBit;
+        key ^= z.pieces[them][captured][to];
+    }
+    byType[type] ^= fromBit | toBit;
+    byColor[us] ^= fromBit | toBit;
+    key ^= z.pieces[us][type][from] ^ z.pieces[us][type][to];
+    
+    if (type == PAWN) {
+        if (to == previousEnPassant) {
+            int victim = to - forward;
+            byType[PAWN] ^= 1ULL << victim;
+            byColor[them] ^= 1ULL << victim;
+            key ^= z.pieces[them][PAWN][victim];
+            captured = PAWN;
+        } else if (to - from == 2 * forward) {
+            enPassant = from + forward;
+            key ^= z.enPassantFile[enPassant % 8];
+        } else if (to / 8 == ColorTraits<C>::promotionRank) {
+            int promotion = movePromotion(move) ? movePromotion(move) : QUEEN;
+            byType[PAWN] ^= toBit;
+            byType[promotion] ^= toBit;
+            key ^= z.pieces[us][PAWN][to] ^ z.pieces[us][promotion][to];
+        }
+    } else if (type == KING && (to - from == 2 || from - to == 2)) {
+        int rookFrom = to > from ? from + 3 : from - 4;
+        int rookTo = (from + to) / 2;
+        byType[ROOK] ^= (1ULL << rookFrom) | (1ULL << rookTo);
+        byColor[us] ^= (1ULL << rookFrom) | (1ULL << rookTo);
+        key ^= z.pieces[us][ROOK][rookFrom] ^ z.pieces[us][ROOK][rookTo];
+    }
+    
+    uint8_t lost = castling & (castlingRightsLost(from) | castlingRightsLost(to));
+    castling &= ~lost;
+    for (int i = 0; i < 4; i++) {
+        if (lost & (1 << i)) {
+            key ^= z.castling[i];
+        }
+    }
+    
+    rule50 = (type == PAWN || captured != -1) ? 0 : (rule50 < 255 ? rule50 + 1 : 255);
+    whiteToMove = !whiteToMove;
+    ply++;
+}
+
+bool CompactPosition::isInsufficientMaterial() const {
+    // Same combinations as Board::isDrawByInsufficientMaterial
+    if (byType[PAWN] | byType[ROOK] | byType[QUEEN]) {
+        return false;
+    }
+    int whiteMinors = __builtin_popcountll(byColor[0] & (byType[KNIGHT] | byType[BISHOP]));
+    int blackMinors = __builtin_popcountll(byColor[1] & (byType[KNIGHT] | byType[BISHOP]));
+    if (whiteMinors + blackMinors <= 1) {
+        return true;
+    }
+    if (byType[KNIGHT] == 0 && whiteMinors == 1 && blackMinors == 1) {
+        // Bishops on squares of the same colour
+        constexpr uint64_t darkSquares = 0xAA55AA55AA55AA55ULL;
+        return ((byType[BISHOP] & darkSquares) == 0) || ((byType[BISHOP] & ~darkSquares) == 0);
+    }
+    return false;
+}
+
+int KeyHistory::repetitions(int limit) const {
+    // Same side to move, so every second entry from four plies back
+    int count = 0;
+    int last = keys.size() - 1;
+    for (int back = 4; back <= last && count < limit; back += 2) {
+        if (keys[last - back] == keys.back()) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int CompactPosition::materialBalance() const {
+    int score = 0;
+    for (int type = PAWN; type < KING; type++) {
+        score += PIECE_VALUES[type] * (__builtin_popcountll(pieces(0, type)) - __builtin_popcountll(pieces(1, type)));
+    }
+    return whiteToMove ? score : -score;
+}
+
+GameStatus CompactPosition::status(int legalMoves) const {
+    if (legalMoves == 0) {
+        if (!inCheck()) {
+            return GameStatus::Stalemate;
+        }
+        return whiteToMove ? GameStatus::BlackWins : GameStatus::WhiteWins;
+    }
+    if (rule50 >= 100) {
+        return GameStatus::DrawByFiftyMoves;
+    }
+    if (isInsufficientMaterial()) {
+        return GameStatus::DrawByInsufficientMaterial;
+    }
+    return GameStatus::Ongoing;
+}
+
+bool Board::isWhiteToMove() const {
+    return savedStates == 0 || savedStates % 2 == 1;
+}
+
+CompactPosition Board::compactPosition() const {
+    if (compactCacheValid) {
+        return compactCache;
+    }
+    CompactPosition position = {};
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            Piece* piece = board[y][x];
+            if (piece != nullptr) {
+                position.byType[pieceIndexOf(piece)] |= 1ULL << (x + 8 * y);
+                position.byColor[piece->white ? 0 : 1] |= 1ULL << (x + 8 * y);
+            }
+        }
+    }
+    BoardState state = getCurrentBoardState();
+    position.castling = (state.whiteCanCastleKingside ? 1 : 0) | (state.whiteCanCastleQueenside ? 2 : 0) |
+                        (state.blackCanCastleKingside ? 4 : 0) | (state.blackCanCastleQueenside ? 8 : 0);
+    position.enPassant = state.enPassantTarget.first == -1 ? -1 :
+                         state.enPassantTarget.first + 8 * state.enPassantTarget.second;
+    position.whiteToMove = isWhiteToMove();
+    position.rule50 = stateHistory.empty() ? 0 : std::min(stateHistory.back().rule50, 255);
+    position.ply = savedStates > 0 ? savedStates - 1 : 0;
+    position.key = position.computeKey();
+    compactCache = position;
+    compactCacheValid = true;
+    return position;
+}
+
+// Many concurrent games in one process. Game records live in one slab and move lists in an
+// arena of 64-byte chunks, both reused through free lists; a GameId finds its record in O(1).
+class GameSessionManager {
+    public:
+        typedef uint64_t GameId; // Slot in the low 32 bits, generation of the slot in the high 32
+        struct MoveRequest {
+            GameId game;
+            uint16_t move;
+        };
+        
+        GameId createGame(const CompactPosition& start = CompactPosition::startPosition());
+        void endGame(GameId id); // Releases the slot and the move list
+        const CompactPosition* position(GameId id) const; // nullptr for unknown ids; invalidated by createGame
+        GameStatus status(GameId id) const;
+        GameStatus applyMove(GameId id, uint16_t move);
+        void applyMoves(const MoveRequest* requests, size_t count, GameStatus* results);
+        void moveList(GameId id, std::vector<uint16_t>& moves) const;
+        size_t activeGames() const { return games.size() - freeSlots.size(); }
+        size_t memoryUsage() const; // Bytes held by the slab, the arena and the free lists
+    private:
+        static const uint32_t NO_CHUNK = 0xFFFFFFFF;
+        static const int MOVES_PER_CHUNK = 30;
+        struct MoveChunk {
+            uint16_t moves[MOVES_PER_CHUNK];
+            uint32_t previous; // Chunks are linked from the newest back to the first
+        };
+        struct Game {
+            CompactPosition position;
+            uint32_t generation;
+            uint32_t lastChunk;
+            uint32_t moveCount;
+            uint8_t window; // Moves since the last pawn move, capture or castling-rights change
+            bool windowStartEnPassant; // The position at the start of the window had an en passant square
+            GameStatus status;
+            bool active;
+        };
+        std::vector<Game> games;
+        std::vector<uint32_t> freeSlots;
+        std::vector<MoveChunk> chunks;
+        std::vector<uint32_t> freeChunks;
+        
+        Game* find(GameId id);
+        const Game* find(GameId id) const;
+        void appendMove(Game& game, uint16_t move);
+        bool isThreefoldRepetition(const Game& game) const;
+};
+
+GameSessionManager::GameId GameSessionManager::createGame(const CompactPosition& start) {
+    uint32_t slot;
+    if (!freeSlots.empty()) {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    } else {
+        slot = games.size();
+        games.push_back(Game());
+        games[slot].generation = 0;
+    }
+    Game& game = games[slot];
+    game.position = start;
+    game.lastChunk = NO_CHUNK;
+    game.moveCount = 0;
+    game.window = 0;
+    game.windowStartEnPassant = start.enPassant != -1;
+    game.active = true;
+    game.status = start.status(start.hasLegalMove() ? 1 : 0);
+    return (GameId)game.generation << 32 | slot;
+}
+
+void GameSessionManager::endGame(GameId id) {
+    Game* game = find(id);
+    if (game == nullptr) {
+        return;
+    }
+    for (uint32_t chunk = game->lastChunk; chunk != NO_CHUNK; chunk = chunks[chunk].previous) {
+        freeChunks.push_back(chunk);
+    }
+    game->active = false;
+    game->generation++;
+    freeSlots.push_back((uint32_t)id);
+}
+
+GameSessionManager::Game* GameSessionManager::find(GameId id) {
+    uint32_t slot = (uint32_t)id;
+    if (slot >= games.size() || !games[slot].active || games[slot].generation != (uint32_t)(id >> 32)) {
+        return nullptr;
+    }
+    return &games[slot];
+}
+
+const GameSessionManager::Game* GameSessionManager::find(GameId id) const {
+    return const_cast<GameSessionManager*>(this)->find(id);
+}
+
+const CompactPosition* GameSessionManager::position(GameId id) const {
+    const Game* game = find(id);
+    return game ? &game->position : nullptr;
+}
+
+GameStatus GameSessionManager::status(GameId id) const {
+    const Game* game = find(id);
+    return game ? game->status : GameStatus::UnknownGame;
+}
+
+void GameSessionManager::appendMove(Game& game, uint16_t move) {
+    int offset = game.moveCount % MOVES_PER_CHUNK;
+    if (offset == 0) {
+        uint32_t chunk;
+        if (!freeChunks.empty()) {
+            chunk = freeChunks.back();
+            freeChunks.pop_back();
+        } else {
+            chunk = chunks.size();
+            chunks.push_back(MoveChunk());
+        }
+        chunks[chunk].previous = game.lastChunk;
+        game.lastChunk = chunk;
+    }
+    chunks[game.lastChunk].moves[offset] = move;
+    game.moveCount++;
+}
+
+void GameSessionManager::moveList(GameId id, std::vector<uint16_t>& moves) const {
+    moves.clear();
+    const Game* game = find(id);
+    if (game == nullptr) {
+        return;
+    }
+    moves.resize(game->moveCount);
+    uint32_t chunk = game->lastChunk;
+    for (int i = game->moveCount - 1; i >= 0; i--) {
+        moves[i] = chunks[chunk].moves[i % MOVES_PER_CHUNK];
+        if (i % MOVES_PER_CHUNK == 0) {
+            chunk = chunks[chunk].previous;
+        }
+    }
+}
+
+bool GameSessionManager::isThreefoldRepetition(const Game& game) const {
+    if (game.window < 8) {
+        return false;
+    }
+    // Every move in the window is a plain piece move, so it can be undone on the bitboards
+    // alone while the key is updated alongside; no position history is stored per game.
+    const Zobrist& z = zobrist();
+    CompactPosition earlier = game.position;
+    int repetitions = 0;
+    uint32_t chunk = game.lastChunk;
+    for (int back = 1; back <= game.window; back++) {
+        int index = game.moveCount - back;
+        uint16_t move = chunks[chunk].moves[index % MOVES_PER_CHUNK];
+        if (index % MOVES_PER_CHUNK == 0) {
+            chunk = chunks[chunk].previous;
+        }
+        int from = moveFrom(move);
+        int to = moveTo(move);
+        int color = earlier.whiteToMove ? 1 : 0; // The side that made this move
+        int type = earlier.pieceOn(to);
+        uint64_t bits = (1ULL << from) | (1ULL << to);
+        earlier.byType[type] ^= bits;
+        earlier.byColor[color] ^= bits;
+        earlier.key ^= z.pieces[color][type][from] ^ z.pieces[color][type][to] ^ z.side;
+        earlier.whiteToMove = !earlier.whiteToMove;
+        
+        bool windowStart = back == game.window;
+        if (back % 2 == 0 && earlier.key == game.position.key && !(windowStart && game.windowStartEnPassant) &&
+            ++repetitions == 2) {
+            return true;
+        }
+    }
+    return false;
+}
+
+GameStatus GameSessionManager::applyMove(GameId id, uint16_t move) {
+    Game* game = find(id);
+    if (game == nullptr) {
+        return GameStatus::UnknownGame;
+    }
+    if (game->status != GameStatus::Ongoing) {
+        return game->status;
+    }
+    
+    // A pawn reaching the last rank without a promotion piece promotes to a queen, as in Board
+    CompactPosition& position = game->position;
+    if (movePromotion(move) == 0 && position.pieceOn(moveFrom(move)) == PAWN &&
+        (moveTo(move) / 8 == 0 || moveTo(move) / 8 == 7)) {
+        move = packMove(moveFrom(move), moveTo(move), QUEEN);
+    }
+    if (!position.isLegal(move)) {
+        return GameStatus::IllegalMove;
+    }
+    
+    uint8_t castlingBefore = position.castling;
+    position.makeMove(move);
+    appendMove(*game, move);
+    if (position.rule50 == 0 || position.castling != castlingBefore) {
+        game->window = 0;
+        game->windowStartEnPassant = position.enPassant != -1;
+    } else if (game->window < 255) {
+        game->window++;
+    }
+    
+    game->status = position.status(position.hasLegalMove() ? 1 : 0);
+    if (game->status == GameStatus::Ongoing && isThreefoldRepetition(*game)) {
+        game->status = GameStatus::DrawByRepetition;
+    }
+    return game->status;
+}
+
+void GameSessionManager::applyMoves(const MoveRequest* requests, size_t count, GameStatus* results) {
+    for (size_t i = 0; i < count; i++) {
+        // Games are scattered over the slab; fetch the next record while this one is worked on
+        if (i + 1 < count && (uint32_t)requests[i + 1].game < games.size()) {
+            __builtin_prefetch(&games[(uint32_t)requests[i + 1].game]);
+        }
+        results[i] = applyMove(requests[i].game, requests[i].move);
+    }
+}
+
+size_t GameSessionManager::memoryUsage() const {
+    return games.capacity() * sizeof(Game) + chunks.capacity() * sizeof(MoveChunk) +
+           (freeSlots.capacity() + freeChunks.capacity()) * sizeof(uint32_t);
+}
+
+uint64_t CompactPosition::attackersTo(int square, uint64_t occupied) const {
+    uint64_t bit = 1ULL << square;
+    uint64_t empty = ~occupied;
+    return (pawnAttacks<Color::Black>(bit) & pieces(0, PAWN)) |
+           (pawnAttacks<Color::White>(bit) & pieces(1, PAWN)) |
+           (knightAttacks(bit) & byType[KNIGHT]) |
+           (kingAttacks(bit) & byType[KING]) |
+           (diagonalAttacks(bit, empty) & (byType[BISHOP] | byType[QUEEN])) |
+           (orthogonalAttacks(bit, empty) & (byType[ROOK] | byType[QUEEN]));
+}
+
+int CompactPosition::see(uint16_t move) const {
+    int from = moveFrom(move);
+    int to = moveTo(move);
+    int attacker = pieceOn(from);
+    if (attacker == -1) {
+        return 0;
+    }
+    if (attacker == KING && (to - from == 2 || from - to == 2)) {
+        return 0; // Castling
+    }
+    int side = (byColor[0] >> from) & 1 ? 0 : 1;
+    uint64_t occupied = this->occupied() ^ (1ULL << from);
+    
+    // gain[d] is the material balance for the side making capture d if the exchange stops there
+    int gain[32];
+    int captured = pieceOn(to);
+    if (attacker == PAWN && to == enPassant) {
+        captured = PAWN;
+        occupied ^= 1ULL << (to + (side == 0 ? -8 : 8));
+    }
+    gain[0] = captured == -1 ? 0 : PIECE_VALUES[captured];
+    if (attacker == PAWN && (to / 8 == 0 || to / 8 == 7)) {
+        attacker = movePromotion(move) ? movePromotion(move) : QUEEN;
+        gain[0] += PIECE_VALUES[attacker] - PIECE_VALUES[PAWN];
+    }
+    
+    uint64_t attackers = attackersTo(to, occupied) & occupied;
+    int depth = 0;
+    while (true) {
+        side = 1 - side;
+        uint64_t ours = attackers & byColor[side];
+        if (!ours) {
+            break;
+        }
+        // Least valuable attacker first
+        int type = PAWN;
+        while (!(ours & byType[type])) {
+            type++;
+        }
+        if (type == KING && (attackers & byColor[1 - side])) {
+            break; // The king cannot capture onto a defended square
+        }
+        depth++;
+        gain[depth] = PIECE_VALUES[attacker] - gain[depth - 1];
+        uint64_t bit = ours & byType[type];
+        occupied ^= bit & -bit;
+        // Removing a piece may uncover a slider behind it
+        attackers = attackersTo(to, occupied) & occupied;
+        attacker = type;
+    }
+    while (depth > 0) {
+        gain[depth - 1] = -std::max(-gain[depth - 1], gain[depth]);
+        depth--;
+    }
+    return gain[0];
+}
+
+bool CompactPosition::seeGe(uint16_t move, int threshold) const {
+    int from = moveFrom(move);
+    int to = moveTo(move);
+    int attacker = pieceOn(from);
+    if (attacker == -1 || (attacker == KING && (to - from == 2 || from - to == 2)) ||
+        (attacker == PAWN && (to == enPassant || to / 8 == 0 || to / 8 == 7))) {
+        return see(move) >= threshold; // Rare cases go through the full exchange
+    }
+    int captured = pieceOn(to);
+    
+    // swap is what the side to move still has to win (or may lose) as captures alternate
+    int swap = (captured == -1 ? 0 : PIECE_VALUES[captured]) - threshold;
+    if (swap < 0) {
+        return false;
+    }
+    swap = PIECE_VALUES[attacker] - swap;
+    if (swap <= 0) {
+        return true;
+    }
+    
+    int side = (byColor[0] >> from) & 1 ? 0 : 1;
+    uint64_t occupied = this->occupied() ^ (1ULL << from) ^ (1ULL << to);
+    uint64_t attackers = attackersTo(to, occupied);
+    int result = 1;
+    while (true) {
+        side = 1 - side;
+        attackers &= occupied;
+        uint64_t ours = attackers & byColor[side];
+        if (!ours) {
+            break;
+        }
+        result ^= 1;
+        int type = PAWN;
+        while (!(ours & byType[type])) {
+            type++;
+        }
+        if (type == KING) {
+            // Capturing with the king only works if the opponent has nothing left
+            return (attackers & byColor[1 - side]) ? result ^ 1 : result;
+        }
+        if ((swap = PIECE_VALUES[type] - swap) < result) {
+            break;
+        }
+        uint64_t bit = ours & byType[type];
+        occupied ^= bit & -bit;
+        attackers = attackersTo(to, occupied);
+    }
+    return result;
+}
+
+static uint16_t packBoardMove(const Board& board, const std::pair<int, int>& from, const std::pair<int, int>& to) {
+    int promotion = dynamic_cast<Pawn*>(board.board[from.second][from.first]) && (to.second == 0 || to.second == 7)
+                    ? QUEEN : 0; // movePiece promotes to a queen by default
+    return packMove(from.first + 8 * from.second, to.first + 8 * to.second, promotion);
+}
+
+int Board::see(const std::pair<int, int>& from, const std::pair<int, int>& to) const {
+    if (from.first < 0 || from.first > 7 || from.second < 0 || from.second > 7 ||
+        to.first < 0 || to.first > 7 || to.second < 0 || to.second > 7) {
+        return 0;
+    }
+    return compactPosition().see(packBoardMove(*this, from, to));
+}
+
+bool Board::seeGe(const std::pair<int, int>& from, const std::pair<int, int>& to, int threshold) const {
+    if (from.first < 0 || from.first > 7 || from.second < 0 || from.second > 7 ||
+        to.first < 0 || to.first > 7 || to.second < 0 || to.second > 7) {
+        return 0 >= threshold;
+    }
+    return compactPosition().seeGe(packBoardMove(*this, from, to), threshold);
+}
+
+bool PackedPosition::pack(const CompactPosition& position) {
+    uint64_t all = position.occupied();
+    if (__builtin_popcountll(all) > 32) {
+        return false;
+    }
+    occupied = all;
+    memset(pieces, 0, sizeof(pieces));
+    // Castling rights are stored on the rook that still has them
+    uint64_t castlingRooks = ((position.castling & 1) ? 1ULL << 7 : 0) | ((position.castling & 2) ? 1ULL : 0) |
+                             ((position.castling & 4) ? 1ULL << 63 : 0) | ((position.castling & 8) ? 1ULL << 56 : 0);
+    int enPassantPawn = position.enPassant == -1 ? -1 : position.enPassant + (position.whiteToMove ? -8 : 8);
+    int index = 0;
+    for (uint64_t b = all; b; b &= b - 1, index++) {
+        int square = __builtin_ctzll(b);
+        int color = (position.byColor[0] >> square) & 1 ? 0 : 1;
+        int type = position.pieceOn(square);
+        int code = type + 6 * color;
+        if (square == enPassantPawn) {
+            code = 12;
+        } else if (type == ROOK && (castlingRooks >> square) & 1) {
+            code = 13 + color;
+        } else if (type == KING && color == 1 && !position.whiteToMove) {
+            code = 15;
+        }
+        pieces[index / 2] |= code << (4 * (index % 2));
+    }
+    rule50 = position.rule50;
+    fullmove = position.ply / 2 + 1;
+    // Labels default to unknown so no caller writes uninitialised bytes to disk
+    result = 0;
+    eval = 0;
+    bestMove = 0;
+    return true;
+}
+
+CompactPosition PackedPosition::unpack() const {
+    CompactPosition position = {};
+    position.enPassant = -1;
+    position.whiteToMove = true;
+    int index = 0;
+    for (uint64_t b = occupied; b; b &= b - 1, index++) {
+        int square = __builtin_ctzll(b);
+        int code = (pieces[index / 2] >> (4 * (index % 2))) & 15;
+        int color, type;
+        if (code < 12) {
+            color = code / 6;
+            type = code % 6;
+        } else if (code == 12) {
+            // Only the side that did not just move can capture en passant, so the pawn is the other colour
+            color = square < 32 ? 0 : 1;
+            type = PAWN;
+            position.enPassant = square + (color == 0 ? -8 : 8);
+        } else if (code < 15) {
+            color = code - 13;
+            type = ROOK;
+            position.castling |= (square % 8 == 7 ? 1 : 2) << (2 * color);
+        } else {
+            color = 1;
+            type = KING;
+            position.whiteToMove = false;
+        }
+        position.byType[type] |= 1ULL << square;
+        position.byColor[color] |= 1ULL << square;
+    }
+    position.rule50 = rule50;
+    position.ply = (fullmove - 1) * 2 + (position.whiteToMove ? 0 : 1);
+    position.key = position.computeKey();
+    return position;
+}
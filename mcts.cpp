@@ -0,0 +1,434 @@
+// Monte Carlo tree search (PUCT) over CompactPosition, grown by several threads at once.
+//
+// Nodes come from a pool that hands out runs of consecutive nodes with one atomic add; the
+// children of a node are one run. Moving the root to a child copies that subtree into a
+// second pool and swaps the two, so the statistics gathered for the move actually played are
+// kept and everything else is released at once. Threads descend concurrently: each visit in
+// flight counts as a loss for the node (virtual loss) until its result is backed up, which
+// spreads the threads over different lines. Leaves are scored by a LeafEvaluator, a random
+// playout by default. Mate, stalemate, fifty moves and insufficient material come from
+// CompactPosition::status, and a repetition inside the search is scored as a draw.
+//
+// Build: g++ -std=c++17 -O2 -march=native mcts.cpp -o mcts -pthread
+// Usage: mcts [playouts=100000] [moves=1] [threads=all] [evaluator=playout|material] [nodes=4000000]
+//   Plays moves moves from the start position, spending playouts playouts on each and reusing
+//   the subtree of the move played.
+#include "chessRule.cpp"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Scores a leaf for the side to move, in [-1, 1]. When priors is not null the evaluator may
+// write a prior for each of the count legal moves; they are uniform otherwise.
+class LeafEvaluator {
+    public:
+        virtual ~LeafEvaluator() = default;
+        virtual float evaluate(const CompactPosition& position, const uint16_t* moves, int count,
+                               float* priors, SplitMix64& rng) const = 0;
+};
+
+// Plays random legal moves until the library adjudicates the game
+class RandomPlayout : public LeafEvaluator {
+    public:
+        static const int MAX_PLIES = 1000; // Scored as a draw beyond this
+        float evaluate(const CompactPosition& position, const uint16_t* moves, int count,
+                       float* priors, SplitMix64& rng) const override;
+};
+
+float RandomPlayout::evaluate(const CompactPosition& start, const uint16_t* moves, int count,
+                              float*, SplitMix64& rng) const {
+    CompactPosition position = start;
+    uint16_t playoutMoves[CompactPosition::MAX_MOVES];
+    KeyHistory history;
+    history.reset(position);
+    position.makeMove(moves[rng.below(count)]);
+    history.push(position);
+    for (int ply = 1; ply < MAX_PLIES; ply++) {
+        int legal = position.generateLegalMoves(playoutMoves);
+        GameStatus status = position.status(legal);
+        if (status == GameStatus::WhiteWins || status == GameStatus::BlackWins) {
+            // The side to move at ply is mated; that is the starting side when ply is even
+            return ply % 2 == 0 ? -1.0f : 1.0f;
+        }
+        if (status != GameStatus::Ongoing) {
+            return 0.0f;
+        }
+        if (history.repetitions(2) == 2) {
+            return 0.0f;
+        }
+        position.makeMove(playoutMoves[rng.below(legal)]);
+        history.push(position);
+    }
+    return 0.0f;
+}
+
+// Material balance squashed into [-1, 1], with captures that win material preferred in the priors
+class MaterialEvaluator : public LeafEvaluator {
+    public:
+        float evaluate(const CompactPosition& position, const uint16_t* moves, int count,
+                       float* priors, SplitMix64& rng) const override;
+};
+
+float MaterialEvaluator::evaluate(const CompactPosition& position, const uint16_t* moves, int count,
+                                  float* priors, SplitMix64&) const {
+    if (priors != nullptr) {
+        float total = 0;
+        for (int i = 0; i < count; i++) {
+            priors[i] = position.pieceOn(moveTo(moves[i])) != -1 && position.seeGe(moves[i], 1) ? 4.0f : 1.0f;
+            total += priors[i];
+        }
+        for (int i = 0; i < count; i++) {
+            priors[i] /= total;
+        }
+    }
+    return std::tanh(position.materialBalance() / 400.0f);
+}
+
+enum NodeState : uint8_t { Unexpanded, Expanding, Expanded, Terminal };
+
+// 32 bytes. valueSum is from the point of view of the side that made move, scaled by VALUE_SCALE.
+struct MctsNode {
+    std::atomic<int64_t> valueSum;
+    std::atomic<uint32_t> visits;
+    std::atomic<uint32_t> virtualLoss; // Visits in flight
+    uint32_t firstChild;
+    float prior;
+    uint16_t move;
+    uint16_t childCount;
+    std::atomic<uint8_t> state;
+    int8_t terminalValue; // For the side to move, when state is Terminal
+};
+static_assert(sizeof(MctsNode) == 32, "MctsNode is meant to fill half a cache line");
+
+static const int64_t VALUE_SCALE = 1 << 16;
+static const uint32_t NO_NODE = ~0U;
+
+class NodePool {
+    public:
+        explicit NodePool(uint32_t capacity) : nodes(new MctsNode[capacity]), capacity(capacity) {}
+        uint32_t allocate(uint32_t count); // First of count consecutive nodes, NO_NODE when full
+        MctsNode& operator[](uint32_t index) { return nodes[index]; }
+        const MctsNode& operator[](uint32_t index) const { return nodes[index]; }
+        uint32_t size() const { return used.load(std::memory_order_relaxed); }
+        void clear() { used = 0; }
+    private:
+        std::unique_ptr<MctsNode[]> nodes; // Pages are only touched once nodes are handed out
+        uint32_t capacity;
+        std::atomic<uint32_t> used{0};
+};
+
+uint32_t NodePool::allocate(uint32_t count) {
+    // used never passes capacity, so a full pool can be asked again and again without wrapping
+    uint32_t first = used.load(std::memory_order_relaxed);
+    do {
+        if (count > capacity - first) {
+            return NO_NODE;
+        }
+    } while (!used.compare_exchange_weak(first, first + count, std::memory_order_relaxed));
+    return first;
+}
+
+static void initNode(MctsNode& node, uint16_t move, float prior) {
+    node.valueSum.store(0, std::memory_order_relaxed);
+    node.visits.store(0, std::memory_order_relaxed);
+    node.virtualLoss.store(0, std::memory_order_relaxed);
+    node.firstChild = NO_NODE;
+    node.prior = prior;
+    node.move = move;
+    node.childCount = 0;
+    node.state.store(Unexpanded, std::memory_order_relaxed);
+    node.terminalValue = 0;
+}
+
+class MctsSearch {
+    public:
+        static constexpr float CPUCT = 1.5f;
+
+        MctsSearch(const LeafEvaluator& evaluator, uint32_t nodeCapacity);
+        void setPosition(const CompactPosition& position); // Drops the tree
+        void search(uint64_t playouts, unsigned threadCount, uint64_t seed);
+        uint16_t bestMove() const; // Most visited root move, 0 if none
+        void advance(uint16_t move); // Plays move and keeps its subtree
+        const CompactPosition& position() const { return rootPosition; }
+        uint32_t nodeCount() const { return pools[current]->size(); }
+        uint32_t rootVisits() const { return (*pools[current])[root].visits; }
+        size_t memoryUsage() const { return (size_t)(pools[0]->size() + pools[1]->size()) * sizeof(MctsNode); }
+        bool treeFull() const { return full; }
+    private:
+        const LeafEvaluator& evaluator;
+        std::unique_ptr<NodePool> pools[2];
+        int current = 0;
+        uint32_t root = 0;
+        CompactPosition rootPosition;
+        KeyHistory history; // Up to the root
+        std::atomic<bool> full{false};
+
+        void playout(SplitMix64& rng);
+        float expand(uint32_t index, const CompactPosition& position, const KeyHistory& keys,
+                     bool isRoot, SplitMix64& rng);
+        uint32_t select(const MctsNode& node) const;
+};
+
+MctsSearch::MctsSearch(const LeafEvaluator& evaluator, uint32_t nodeCapacity) : evaluator(evaluator) {
+    pools[0].reset(new NodePool(nodeCapacity));
+    pools[1].reset(new NodePool(nodeCapacity));
+    setPosition(CompactPosition::startPosition());
+}
+
+void MctsSearch::setPosition(const CompactPosition& position) {
+    rootPosition = position;
+    history.reset(position);
+    pools[current]->clear();
+    root = pools[current]->allocate(1);
+    initNode((*pools[current])[root], 0, 1.0f);
+    full = false;
+}
+
+// Called by the thread that won the Unexpanded -> Expanding race. Returns the value of the
+// position for the side to move.
+float MctsSearch::expand(uint32_t index, const CompactPosition& position, const KeyHistory& keys,
+                         bool isRoot, SplitMix64& rng) {
+    NodePool& pool = *pools[current];
+    MctsNode& node = pool[index];
+    uint16_t moves[CompactPosition::MAX_MOVES];
+    int count = position.generateLegalMoves(moves);
+    GameStatus status = position.status(count);
+    if (status != GameStatus::Ongoing || (!isRoot && keys.repetitions(1) > 0)) {
+        node.terminalValue = status == GameStatus::WhiteWins || status == GameStatus::BlackWins ? -1 : 0;
+        node.state.store(Terminal, std::memory_order_release);
+        return node.terminalValue;
+    }
+
+    float priors[CompactPosition::MAX_MOVES];
+    for (int i = 0; i < count; i++) {
+        priors[i] = 1.0f / count;
+    }
+    float value = evaluator.evaluate(position, moves, count, priors, rng);
+    uint32_t first = pool.allocate(count);
+    if (first == NO_NODE) {
+        full = true; // Keep scoring this leaf until the tree is rebuilt
+        node.state.store(Unexpanded, std::memory_order_release);
+        return value;
+    }
+    for (int i = 0; i < count; i++) {
+        initNode(pool[first + i], moves[i], priors[i]);
+    }
+    node.firstChild = first;
+    node.childCount = count;
+    node.state.store(Expanded, std::memory_order_release);
+    return value;
+}
+
+uint32_t MctsSearch::select(const MctsNode& node) const {
+    const NodePool& pool = *pools[current];
+    uint32_t parentVisits = node.visits.load(std::memory_order_relaxed) + node.virtualLoss.load(std::memory_order_relaxed);
+    float exploration = CPUCT * std::sqrt((float)std::max(parentVisits, 1U));
+    uint32_t best = node.firstChild;
+    float bestScore = -1e30f;
+    for (uint32_t i = node.firstChild; i < node.firstChild + node.childCount; i++) {
+        const MctsNode& child = pool[i];
+        uint32_t visits = child.visits.load(std::memory_order_relaxed);
+        uint32_t inFlight = child.virtualLoss.load(std::memory_order_relaxed);
+        float q = 0; // Unvisited moves start out level
+        if (visits + inFlight > 0) {
+            q = ((float)child.valueSum.load(std::memory_order_relaxed) / VALUE_SCALE - inFlight) / (visits + inFlight);
+        }
+        float score = q + exploration * child.prior / (1 + visits + inFlight);
+        if (score > bestScore) {
+            bestScore = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+void MctsSearch::playout(SplitMix64& rng) {
+    NodePool& pool = *pools[current];
+    CompactPosition position = rootPosition;
+    KeyHistory keys = history;
+    uint32_t path[1024];
+    int depth = 0;
+    path[0] = root;
+    pool[root].virtualLoss.fetch_add(1, std::memory_order_relaxed);
+    float value;
+    while (true) {
+        MctsNode& node = pool[path[depth]];
+        uint8_t state = node.state.load(std::memory_order_acquire);
+        if (state == Terminal) {
+            value = node.terminalValue;
+            break;
+        }
+        if (state == Unexpanded &&
+            node.state.compare_exchange_strong(state, Expanding, std::memory_order_acquire)) {
+            value = expand(path[depth], position, keys, depth == 0, rng);
+            break;
+        }
+        if (state != Expanded || depth == 1023) {
+            // Another thread is expanding this node: score it without expanding
+            uint16_t moves[CompactPosition::MAX_MOVES];
+            int count = position.generateLegalMoves(moves);
+            value = count == 0 ? (position.inCheck() ? -1.0f : 0.0f)
+                               : evaluator.evaluate(position, moves, count, nullptr, rng);
+            break;
+        }
+        uint32_t child = select(node);
+        pool[child].virtualLoss.fetch_add(1, std::memory_order_relaxed);
+        position.makeMove(pool[child].move);
+        keys.push(position);
+        path[++depth] = child;
+    }
+
+    // value is for the side to move at the leaf; each node stores it for the side that moved into it
+    for (; depth >= 0; depth--) {
+        MctsNode& node = pool[path[depth]];
+        value = -value;
+        node.valueSum.fetch_add((int64_t)(value * VALUE_SCALE), std::memory_order_relaxed);
+        node.visits.fetch_add(1, std::memory_order_relaxed);
+        node.virtualLoss.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void MctsSearch::search(uint64_t playouts, unsigned threadCount, uint64_t seed) {
+    std::atomic<uint64_t> started(0);
+    auto worker = [&](unsigned thread) {
+        SplitMix64 rng = {seed ^ (thread * 0xD1B54A32D192ED03ULL)};
+        while (started.fetch_add(1, std::memory_order_relaxed) < playouts) {
+            playout(rng);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+uint16_t MctsSearch::bestMove() const {
+    const NodePool& pool = *pools[current];
+    const MctsNode& node = pool[root];
+    if (node.state.load(std::memory_order_acquire) != Expanded) {
+        return 0;
+    }
+    uint32_t best = node.firstChild;
+    for (uint32_t i = node.firstChild; i < node.firstChild + node.childCount; i++) {
+        if (pool[i].visits > pool[best].visits) {
+            best = i;
+        }
+    }
+    return pool[best].move;
+}
+
+static void copyNode(const MctsNode& from, MctsNode& to) {
+    to.valueSum.store(from.valueSum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    to.visits.store(from.visits.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    to.virtualLoss.store(0, std::memory_order_relaxed);
+    to.firstChild = NO_NODE;
+    to.prior = from.prior;
+    to.move = from.move;
+    to.childCount = 0;
+    uint8_t state = from.state.load(std::memory_order_relaxed);
+    to.state.store(state == Expanding ? (uint8_t)Unexpanded : state, std::memory_order_relaxed);
+    to.terminalValue = from.terminalValue;
+}
+
+void MctsSearch::advance(uint16_t move) {
+    NodePool& from = *pools[current];
+    NodePool& to = *pools[1 - current];
+    uint32_t child = NO_NODE;
+    if (from[root].state.load() == Expanded) {
+        for (uint32_t i = from[root].firstChild; i < from[root].firstChild + from[root].childCount; i++) {
+            if (from[i].move == move) {
+                child = i;
+            }
+        }
+    }
+
+    rootPosition.makeMove(move);
+    history.push(rootPosition);
+    full = false;
+    if (child == NO_NODE) {
+        from.clear();
+        to.clear();
+        current = 1 - current;
+        root = to.allocate(1);
+        initNode(to[root], 0, 1.0f);
+        return;
+    }
+
+    // Copy the subtree of the move played, one run of children at a time
+    to.clear();
+    uint32_t newRoot = to.allocate(1);
+    copyNode(from[child], to[newRoot]);
+    if (to[newRoot].state.load() == Terminal) {
+        to[newRoot].state.store(Unexpanded); // A repetition draw inside the search may not be one from here
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> pending = {{child, newRoot}}; // Source and copy
+    while (!pending.empty()) {
+        std::pair<uint32_t, uint32_t> next = pending.back();
+        pending.pop_back();
+        const MctsNode& source = from[next.first];
+        if (to[next.second].state.load(std::memory_order_relaxed) != Expanded) {
+            continue;
+        }
+        uint32_t run = to.allocate(source.childCount);
+        to[next.second].firstChild = run;
+        to[next.second].childCount = source.childCount;
+        for (uint32_t i = 0; i < source.childCount; i++) {
+            copyNode(from[source.firstChild + i], to[run + i]);
+            pending.push_back({source.firstChild + i, run + i});
+        }
+    }
+    from.clear();
+    current = 1 - current;
+    root = newRoot;
+}
+
+int main(int argc, char** argv) {
+    uint64_t playouts = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+    int moveCount = argc > 2 ? atoi(argv[2]) : 1;
+    unsigned threadCount = argc > 3 && atoi(argv[3]) > 0 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    std::string evaluatorName = argc > 4 ? argv[4] : "playout";
+    uint32_t nodeCapacity = argc > 5 ? strtoul(argv[5], nullptr, 10) : 4000000;
+    if (threadCount == 0) {
+        threadCount = 1;
+    }
+    RandomPlayout playoutEvaluator;
+    MaterialEvaluator materialEvaluator;
+    const LeafEvaluator* evaluator;
+    if (evaluatorName == "playout") {
+        evaluator = &playoutEvaluator;
+    } else if (evaluatorName == "material") {
+        evaluator = &materialEvaluator;
+    } else {
+        std::cerr << "Unknown evaluator " << evaluatorName << " (playout or material)" << std::endl;
+        return 2;
+    }
+
+    MctsSearch search(*evaluator, nodeCapacity);
+    std::cout << threadCount << " threads, " << evaluatorName << " evaluator, " << sizeof(MctsNode)
+              << " bytes per node" << std::endl;
+    for (int i = 0; i < moveCount; i++) {
+        uint32_t reused = search.rootVisits();
+        auto start = std::chrono::steady_clock::now();
+        search.search(playouts, threadCount, 1 + i);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint16_t move = search.bestMove();
+        if (move == 0) {
+            std::cout << "game over" << std::endl;
+            break;
+        }
+        std::cout << "ply " << search.position().ply + 1 << ": " << moveText(move) << "  "
+                  << (long long)(playouts / seconds) << " playouts/s, " << search.nodeCount() << " nodes ("
+                  << search.memoryUsage() / (1 << 20) << " MB), " << reused << " visits reused"
+                  << (search.treeFull() ? ", tree full" : "") << std::endl;
+        search.advance(move);
+    }
+    return 0;
+}
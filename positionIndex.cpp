@@ -0,0 +1,595 @@
+// On-disk position index: which games reached a given position, and at which ply.
+//
+// Games are replayed through Board and every position reached, the start position at ply 0
+// included, is stored as a (Zobrist key, game id, ply) entry. Each import writes sorted
+// segment files that are memory-mapped and binary-searched at query time, so the archive
+// never has to be loaded.
+// When too many segments pile up, a background thread merges them into one; queries keep
+// using the old segments until the merged one is in place. A text MANIFEST lists the live
+// segments and GAMES maps game ids back to archive files. One writer process at a time.
+//
+// Build: g++ -std=c++17 -O2 positionIndex.cpp -o positionIndex -pthread
+// Usage:
+//   positionIndex append <indexDir> <games.txt>...   Index games, one per line, moves like e2e4 e7e8q
+//   positionIndex merge <indexDir>                    Merge all segments into one
+//   positionIndex query <indexDir> [moves...]         Games that reached the position after these moves
+//   positionIndex query <indexDir> --key <hex>        Same, for a Zobrist key
+#include "chessRule.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct IndexEntry {
+    uint64_t key;
+    uint32_t gameId;
+    uint32_t ply;
+    bool operator<(const IndexEntry& other) const {
+        if (key != other.key) return key < other.key;
+        if (gameId != other.gameId) return gameId < other.gameId;
+        return ply < other.ply;
+    }
+};
+
+// Segment file: 8-byte magic, 8-byte entry count, then the entries sorted by key
+static const char SEGMENT_MAGIC[8] = {'C', 'H', 'E', 'S', 'S', 'I', 'D', 'X'};
+static const size_t SEGMENT_HEADER = 16;
+
+// One segment file mapped read-only
+class IndexSegment {
+    public:
+        std::string name;
+        const IndexEntry* entries = nullptr;
+        size_t count = 0;
+
+        static std::shared_ptr<IndexSegment> open(const std::string& directory, const std::string& name);
+        ~IndexSegment();
+    private:
+        void* mapping = nullptr;
+        size_t mappedBytes = 0;
+};
+
+std::shared_ptr<IndexSegment> IndexSegment::open(const std::string& directory, const std::string& name) {
+    std::string path = directory + "/" + name;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < SEGMENT_HEADER) {
+        close(fd);
+        return nullptr;
+    }
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+
+    std::shared_ptr<IndexSegment> segment(new IndexSegment());
+    segment->name = name;
+    segment->mapping = mapping;
+    segment->mappedBytes = info.st_size;
+    const char* bytes = static_cast<const char*>(mapping);
+    uint64_t count;
+    memcpy(&count, bytes + 8, sizeof(count));
+    if (memcmp(bytes, SEGMENT_MAGIC, 8) != 0 || SEGMENT_HEADER + count * sizeof(IndexEntry) > (size_t)info.st_size) {
+        return nullptr;
+    }
+    segment->entries = reinterpret_cast<const IndexEntry*>(bytes + SEGMENT_HEADER);
+    segment->count = count;
+    // Lookups touch a few pages at random
+    madvise(mapping, info.st_size, MADV_RANDOM);
+    return segment;
+}
+
+IndexSegment::~IndexSegment() {
+    if (mapping != nullptr) {
+        munmap(mapping, mappedBytes);
+    }
+}
+
+// Streams sorted entries into a temporary file and renames it into place when done
+class SegmentWriter {
+    public:
+        bool open(const std::string& path);
+        void append(const IndexEntry& entry);
+        bool finish();
+    private:
+        std::string path;
+        FILE* file = nullptr;
+        uint64_t count = 0;
+        std::vector<IndexEntry> buffer;
+};
+
+bool SegmentWriter::open(const std::string& finalPath) {
+    path = finalPath;
+    file = fopen((path + ".tmp").c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    count = 0;
+    uint64_t placeholder = 0;
+    fwrite(SEGMENT_MAGIC, 1, 8, file);
+    fwrite(&placeholder, sizeof(placeholder), 1, file);
+    return true;
+}
+
+void SegmentWriter::append(const IndexEntry& entry) {
+    buffer.push_back(entry);
+    count++;
+    if (buffer.size() == 65536) {
+        fwrite(buffer.data(), sizeof(IndexEntry), buffer.size(), file);
+        buffer.clear();
+    }
+}
+
+bool SegmentWriter::finish() {
+    fwrite(buffer.data(), sizeof(IndexEntry), buffer.size(), file);
+    buffer.clear();
+    fseek(file, 8, SEEK_SET);
+    fwrite(&count, sizeof(count), 1, file);
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok && rename((path + ".tmp").c_str(), path.c_str()) == 0;
+}
+
+// The 32 pieces of the starting position, reused for every replayed game
+class StartingPieces {
+    public:
+        StartingPieces();
+        ~StartingPieces();
+        void setup(Board& board) const;
+    private:
+        std::vector<Piece*> pieces;
+};
+
+StartingPieces::StartingPieces() {
+    for (int color = 0; color < 2; color++) {
+        bool white = color == 0;
+        pieces.push_back(new Rook(white));
+        pieces.push_back(new Knight(white));
+        pieces.push_back(new Bishop(white));
+        pieces.push_back(new Queen(white));
+        pieces.push_back(new King(white));
+        pieces.push_back(new Bishop(white));
+        pieces.push_back(new Knight(white));
+        pieces.push_back(new Rook(white));
+        for (int x = 0; x < 8; x++) {
+            pieces.push_back(new Pawn(white));
+        }
+    }
+}
+
+StartingPieces::~StartingPieces() {
+    for (Piece* piece : pieces) {
+        delete piece;
+    }
+}
+
+void StartingPieces::setup(Board& board) const {
+    for (int color = 0; color < 2; color++) {
+        int backRank = color == 0 ? 0 : 7;
+        int pawnRank = color == 0 ? 1 : 6;
+        for (int x = 0; x < 8; x++) {
+            board.placePiece(pieces[16 * color + x], {x, backRank});
+            board.placePiece(pieces[16 * color + 8 + x], {x, pawnRank});
+        }
+    }
+    board.initializeBoardHistory();
+}
+
+// Replays a game given as coordinate moves (e2e4, e7e8q) through Board and calls
+// visit(key, ply) for the start position (ply 0) and after every move. Stops at the first malformed or illegal move and
+// returns false in that case.
+template <class Visitor>
+static bool replayGame(const StartingPieces& startingPieces, const std::string& moves, Visitor visit) {
+    Board board;
+    board.setHistoryMode(HistoryMode::Bounded);
+    board.consoleMessages = false;
+    startingPieces.setup(board);
+    std::vector<Piece*> promoted; // Created by promotePawn, deleted with the game
+    bool ok = true;
+    std::istringstream tokens(moves);
+    std::string token;
+    visit(board.stateHistory.back().key, 0);
+    for (uint32_t ply = 1; tokens >> token; ply++) {
+        if (token.size() < 4 || token[0] < 'a' || token[0] > 'h' || token[1] < '1' || token[1] > '8' ||
+            token[2] < 'a' || token[2] > 'h' || token[3] < '1' || token[3] > '8') {
+            ok = false;
+            break;
+        }
+        std::pair<int, int> from = {token[0] - 'a', token[1] - '1'};
+        std::pair<int, int> to = {token[2] - 'a', token[3] - '1'};
+        Piece* piece = board.board[from.second][from.first];
+        if (piece == nullptr || piece->white != board.isWhiteToMove() || !board.isLegal(from, to)) {
+            ok = false;
+            break;
+        }
+        bool promotion = dynamic_cast<Pawn*>(piece) && (to.second == 0 || to.second == 7);
+        board.movePiece(from, to, token.size() > 4 ? token[4] : 'Q');
+        if (promotion) {
+            promoted.push_back(board.board[to.second][to.first]);
+        }
+        visit(board.stateHistory.back().key, ply);
+    }
+    for (Piece* piece : promoted) {
+        delete piece;
+    }
+    return ok;
+}
+
+class PositionIndex {
+    public:
+        static const size_t ENTRIES_PER_SEGMENT = 1 << 24; // 256 MB of entries in memory while importing
+        static const size_t MERGE_THRESHOLD = 8; // Segments before append starts a background merge
+
+        explicit PositionIndex(const std::string& directory) : directory(directory) {}
+        ~PositionIndex() { waitForMerge(); }
+        bool load(); // Reads MANIFEST and maps the segments; an empty directory is an empty index
+        // Indexes one game per line and sets count to the games read; false if the import stopped
+        bool appendGames(std::istream& games, const std::string& source, uint32_t& count);
+        std::vector<IndexEntry> lookup(uint64_t key) const;
+        void startBackgroundMerge();
+        void waitForMerge();
+        size_t segmentCount() const;
+        size_t entryCount() const;
+        std::string gameSource(uint32_t gameId) const; // "archive:line" for a game id
+    private:
+        std::string directory;
+        mutable std::mutex lock;
+        std::vector<std::shared_ptr<IndexSegment>> segments;
+        uint32_t nextSegment = 0;
+        uint32_t nextGame = 0;
+        std::thread merger;
+        std::atomic<bool> mergeFinished{false}; // Set by merger as its last step
+
+        std::string segmentName(uint32_t number) const;
+        bool writeSegment(std::vector<IndexEntry>& entries);
+        bool writeManifest() const; // Caller holds lock
+        void mergeSegments(std::vector<std::shared_ptr<IndexSegment>> inputs);
+};
+
+std::string PositionIndex::segmentName(uint32_t number) const {
+    char name[32];
+    snprintf(name, sizeof(name), "segment-%06u.idx", number);
+    return name;
+}
+
+bool PositionIndex::load() {
+    std::lock_guard<std::mutex> guard(lock);
+    segments.clear();
+    mkdir(directory.c_str(), 0755);
+    std::ifstream manifest(directory + "/MANIFEST");
+    std::string field, value;
+    while (manifest >> field >> value) {
+        if (field == "nextSegment") {
+            nextSegment = std::stoul(value);
+        } else if (field == "nextGame") {
+            nextGame = std::stoul(value);
+        } else if (field == "segment") {
+            std::shared_ptr<IndexSegment> segment = IndexSegment::open(directory, value);
+            if (segment == nullptr) {
+                std::cerr << "Cannot open segment " << value << std::endl;
+                return false;
+            }
+            segments.push_back(segment);
+        }
+    }
+    return true;
+}
+
+bool PositionIndex::writeManifest() const {
+    std::string path = directory + "/MANIFEST";
+    {
+        std::ofstream manifest(path + ".tmp", std::ios::trunc);
+        manifest << "nextSegment " << nextSegment << "\n";
+        manifest << "nextGame " << nextGame << "\n";
+        for (const std::shared_ptr<IndexSegment>& segment : segments) {
+            manifest << "segment " << segment->name << "\n";
+        }
+        if (!manifest.flush()) {
+            return false;
+        }
+    }
+    return rename((path + ".tmp").c_str(), path.c_str()) == 0;
+}
+
+bool PositionIndex::writeSegment(std::vector<IndexEntry>& entries) {
+    std::sort(entries.begin(), entries.end());
+    std::string name;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        name = segmentName(nextSegment++);
+    }
+    std::string path = directory + "/" + name;
+    SegmentWriter writer;
+    bool written = writer.open(path);
+    if (written) {
+        for (const IndexEntry& entry : entries) {
+            writer.append(entry);
+        }
+        written = writer.finish();
+    }
+    entries.clear(); // Consumed either way; the caller stops at the first failure
+    if (!written) {
+        unlink((path + ".tmp").c_str());
+        return false;
+    }
+
+    std::shared_ptr<IndexSegment> segment = IndexSegment::open(directory, name);
+    if (segment == nullptr) {
+        unlink(path.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    segments.push_back(segment);
+    return writeManifest();
+}
+
+bool PositionIndex::appendGames(std::istream& games, const std::string& source, uint32_t& count) {
+    // Count the games first so their ids can be reserved before any segment uses them
+    std::streampos start = games.tellg();
+    std::string line;
+    count = 0;
+    while (std::getline(games, line)) {
+        count++;
+    }
+    games.clear();
+    if (!games.seekg(start)) {
+        std::cerr << source << ": cannot read the games twice" << std::endl;
+        return false;
+    }
+
+    // Record where the ids come from in GAMES, then take them in MANIFEST. An import that
+    // fails later leaves the ids used up, so they are never given to other games.
+    uint32_t firstGame;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        firstGame = nextGame;
+        std::ofstream log(directory + "/GAMES", std::ios::app);
+        log << firstGame << " " << count << " " << source << "\n";
+        if (!log.flush()) {
+            std::cerr << "Cannot write " << directory << "/GAMES" << std::endl;
+            return false;
+        }
+        nextGame = firstGame + count;
+        if (!writeManifest()) {
+            std::cerr << "Cannot write " << directory << "/MANIFEST" << std::endl;
+            return false;
+        }
+    }
+
+    StartingPieces startingPieces;
+    std::vector<IndexEntry> entries;
+    uint32_t gameId = firstGame;
+    for (uint32_t lineNumber = 1; lineNumber <= count && std::getline(games, line); lineNumber++, gameId++) {
+        bool complete = replayGame(startingPieces, line, [&](uint64_t key, uint32_t ply) {
+            entries.push_back({key, gameId, ply});
+        });
+        if (!complete) {
+            std::cerr << source << ":" << lineNumber << ": stopped at an invalid move" << std::endl;
+        }
+        if (entries.size() >= ENTRIES_PER_SEGMENT && !writeSegment(entries)) {
+            std::cerr << source << ": cannot write a segment" << std::endl;
+            return false;
+        }
+    }
+    if (!entries.empty() && !writeSegment(entries)) {
+        std::cerr << source << ": cannot write a segment" << std::endl;
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (segments.size() < MERGE_THRESHOLD) {
+            return true;
+        }
+    }
+    startBackgroundMerge();
+    return true;
+}
+
+std::vector<IndexEntry> PositionIndex::lookup(uint64_t key) const {
+    std::vector<std::shared_ptr<IndexSegment>> snapshot;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        snapshot = segments;
+    }
+    std::vector<IndexEntry> hits;
+    for (const std::shared_ptr<IndexSegment>& segment : snapshot) {
+        const IndexEntry* end = segment->entries + segment->count;
+        const IndexEntry* first = std::lower_bound(segment->entries, end, key,
+            [](const IndexEntry& entry, uint64_t k) { return entry.key < k; });
+        for (; first != end && first->key == key; first++) {
+            hits.push_back(*first);
+        }
+    }
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
+
+void PositionIndex::startBackgroundMerge() {
+    if (merger.joinable()) {
+        if (!mergeFinished) {
+            return; // One merge at a time; the next append will try again
+        }
+        merger.join();
+    }
+    std::vector<std::shared_ptr<IndexSegment>> inputs;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        inputs = segments;
+    }
+    if (inputs.size() < 2) {
+        return;
+    }
+    mergeFinished = false;
+    merger = std::thread([this, inputs]() {
+        mergeSegments(inputs);
+        mergeFinished = true;
+    });
+}
+
+void PositionIndex::waitForMerge() {
+    if (merger.joinable()) {
+        merger.join();
+    }
+}
+
+void PositionIndex::mergeSegments(std::vector<std::shared_ptr<IndexSegment>> inputs) {
+    std::string name;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        name = segmentName(nextSegment++);
+    }
+    SegmentWriter writer;
+    if (!writer.open(directory + "/" + name)) {
+        return;
+    }
+
+    // k-way merge of the sorted inputs
+    typedef std::pair<IndexEntry, size_t> Head; // Entry and the input it came from
+    auto later = [](const Head& a, const Head& b) { return b.first < a.first; };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+    std::vector<size_t> positions(inputs.size(), 0);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i]->count > 0) {
+            heads.push({inputs[i]->entries[0], i});
+        }
+    }
+    while (!heads.empty()) {
+        Head head = heads.top();
+        heads.pop();
+        writer.append(head.first);
+        size_t i = head.second;
+        if (++positions[i] < inputs[i]->count) {
+            heads.push({inputs[i]->entries[positions[i]], i});
+        }
+    }
+    if (!writer.finish()) {
+        return;
+    }
+    std::shared_ptr<IndexSegment> merged = IndexSegment::open(directory, name);
+    if (merged == nullptr) {
+        return;
+    }
+
+    // Swap the merged segment in for its inputs; segments appended meanwhile stay as they are.
+    // Queries still holding an input keep their mapping until they finish.
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<std::shared_ptr<IndexSegment>> remaining = {merged};
+        for (const std::shared_ptr<IndexSegment>& segment : segments) {
+            if (std::find(inputs.begin(), inputs.end(), segment) == inputs.end()) {
+                remaining.push_back(segment);
+            }
+        }
+        segments = remaining;
+        if (!writeManifest()) {
+            return;
+        }
+    }
+    for (const std::shared_ptr<IndexSegment>& input : inputs) {
+        unlink((directory + "/" + input->name).c_str());
+    }
+}
+
+size_t PositionIndex::segmentCount() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return segments.size();
+}
+
+size_t PositionIndex::entryCount() const {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t count = 0;
+    for (const std::shared_ptr<IndexSegment>& segment : segments) {
+        count += segment->count;
+    }
+    return count;
+}
+
+std::string PositionIndex::gameSource(uint32_t gameId) const {
+    std::ifstream log(directory + "/GAMES");
+    uint32_t first, count;
+    std::string source;
+    while (log >> first >> count && std::getline(log >> std::ws, source)) {
+        if (gameId >= first && gameId < first + count) {
+            return source + ":" + std::to_string(gameId - first + 1);
+        }
+    }
+    return "?";
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: positionIndex append <indexDir> <games.txt>...\n"
+                     "       positionIndex merge <indexDir>\n"
+                     "       positionIndex query <indexDir> [moves...] | --key <hex>" << std::endl;
+        return 2;
+    }
+    std::string command = argv[1];
+    PositionIndex index(argv[2]);
+    if (!index.load()) {
+        return 1;
+    }
+
+    if (command == "append") {
+        for (int i = 3; i < argc; i++) {
+            std::ifstream games(argv[i]);
+            if (!games) {
+                std::cerr << "Cannot read " << argv[i] << std::endl;
+                return 1;
+            }
+            uint32_t count;
+            if (!index.appendGames(games, argv[i], count)) {
+                return 1;
+            }
+            std::cout << argv[i] << ": " << count << " games indexed" << std::endl;
+        }
+        index.waitForMerge();
+        std::cout << index.entryCount() << " positions in " << index.segmentCount() << " segments" << std::endl;
+    } else if (command == "merge") {
+        index.startBackgroundMerge();
+        index.waitForMerge();
+        std::cout << index.entryCount() << " positions in " << index.segmentCount() << " segments" << std::endl;
+    } else if (command == "query") {
+        uint64_t key;
+        if (argc == 5 && std::string(argv[3]) == "--key") {
+            key = strtoull(argv[4], nullptr, 16);
+        } else {
+            std::string moves;
+            for (int i = 3; i < argc; i++) {
+                moves += std::string(argv[i]) + " ";
+            }
+            StartingPieces startingPieces;
+            if (!replayGame(startingPieces, moves, [&](uint64_t k, uint32_t) { key = k; })) {
+                std::cerr << "Invalid move sequence" << std::endl;
+                return 1;
+            }
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<IndexEntry> hits = index.lookup(key);
+        double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+        for (const IndexEntry& hit : hits) {
+            std::cout << "game " << hit.gameId << " ply " << hit.ply << " (" << index.gameSource(hit.gameId) << ")" << std::endl;
+        }
+        std::cout << hits.size() << " hits for key " << std::hex << key << std::dec << " in " << micros << " us" << std::endl;
+    } else {
+        std::cerr << "Unknown command " << command << std::endl;
+        return 2;
+    }
+    return 0;
+}
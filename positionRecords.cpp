@@ -0,0 +1,451 @@
+// Position record files: PackedPosition records written as a stream and read back through mmap.
+//
+// A file is a 32-byte header followed by the records. Uncompressed files store the records
+// back to back, so record i is a pointer into the mapping. Compressed files group records
+// into blocks of RECORDS_PER_BLOCK. Each record in a block is XORed with the one before it;
+// consecutive positions of a game share most bytes, so the result is mostly zero runs,
+// which a byte-level run-length code removes. A table of block offsets at the end of the file
+// gives random access, and the reader keeps the last decoded block.
+//
+// Build: g++ -std=c++17 -O2 -march=native positionRecords.cpp -o positionRecords
+// Usage:
+//   positionRecords export <games.bin> <out.rec> [--compress]   Every position of selfPlay games
+//   positionRecords dump <file.rec> [index...]                  Print records as FEN with labels
+//   positionRecords scan <file.rec>                              Read every record, report throughput
+#include "chessRule.cpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char RECORD_MAGIC[8] = {'C', 'H', 'E', 'S', 'S', 'P', 'O', 'S'};
+static const uint32_t RECORD_VERSION = 1;
+static const uint32_t FLAG_COMPRESSED = 1;
+static const size_t RECORDS_PER_BLOCK = 4096;
+
+struct RecordFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t blockTable; // Offset of the block offset table, 0 when uncompressed
+};
+static_assert(sizeof(RecordFileHeader) == 32, "RecordFileHeader is 32 bytes on disk");
+
+// Run-length code for mostly-zero bytes: a control byte c < 128 is followed by c + 1 literal
+// bytes, and c >= 128 stands for c - 126 zero bytes (2 to 129).
+static void encodeBlock(const PackedPosition* records, size_t count, std::vector<uint8_t>& out) {
+    out.clear();
+    uint8_t previous[sizeof(PackedPosition)] = {0};
+    uint8_t literals[128];
+    int literalCount = 0;
+    int zeroRun = 0;
+    auto flushLiterals = [&]() {
+        if (literalCount > 0) {
+            out.push_back(literalCount - 1);
+            out.insert(out.end(), literals, literals + literalCount);
+            literalCount = 0;
+        }
+    };
+    auto flushZeros = [&]() {
+        if (zeroRun == 1) {
+            literals[literalCount++] = 0; // A single zero is cheaper as a literal
+            if (literalCount == 128) {
+                flushLiterals();
+            }
+        } else if (zeroRun > 1) {
+            flushLiterals();
+            out.push_back(zeroRun + 126);
+        }
+        zeroRun = 0;
+    };
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&records[i]);
+        for (size_t j = 0; j < sizeof(PackedPosition); j++) {
+            uint8_t delta = bytes[j] ^ previous[j];
+            previous[j] = bytes[j];
+            if (delta == 0) {
+                if (++zeroRun == 129) {
+                    flushZeros();
+                }
+                continue;
+            }
+            flushZeros();
+            literals[literalCount++] = delta;
+            if (literalCount == 128) {
+                flushLiterals();
+            }
+        }
+    }
+    flushZeros();
+    flushLiterals();
+}
+
+// Returns false if the data does not decode to exactly count records
+static bool decodeBlock(const uint8_t* data, size_t size, PackedPosition* records, size_t count) {
+    uint8_t* out = reinterpret_cast<uint8_t*>(records);
+    size_t total = count * sizeof(PackedPosition);
+    size_t written = 0;
+    for (size_t i = 0; i < size;) {
+        uint8_t control = data[i++];
+        if (control < 128) {
+            size_t length = control + 1;
+            if (i + length > size || written + length > total) {
+                return false;
+            }
+            memcpy(out + written, data + i, length);
+            i += length;
+            written += length;
+        } else {
+            size_t length = control - 126;
+            if (written + length > total) {
+                return false;
+            }
+            memset(out + written, 0, length);
+            written += length;
+        }
+    }
+    if (written != total) {
+        return false;
+    }
+    // Undo the XOR with the previous record
+    for (size_t i = sizeof(PackedPosition); i < total; i++) {
+        out[i] ^= out[i - sizeof(PackedPosition)];
+    }
+    return true;
+}
+
+// Appends records to a file; the file only appears under its name once finish succeeds
+class RecordWriter {
+    public:
+        bool open(const std::string& path, bool compress);
+        void append(const PackedPosition& record);
+        bool finish();
+        uint64_t size() const { return count; }
+    private:
+        std::string path;
+        FILE* file = nullptr;
+        bool compressed = false;
+        uint64_t count = 0;
+        uint64_t offset = 0; // Bytes written so far
+        std::vector<PackedPosition> buffer;
+        std::vector<uint8_t> encoded;
+        std::vector<uint64_t> blockOffsets;
+        void flushBuffer();
+};
+
+bool RecordWriter::open(const std::string& finalPath, bool compress) {
+    path = finalPath;
+    file = fopen((path + ".tmp").c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    compressed = compress;
+    count = 0;
+    blockOffsets.clear();
+    buffer.reserve(RECORDS_PER_BLOCK);
+    RecordFileHeader header = {}; // Rewritten by finish
+    fwrite(&header, sizeof(header), 1, file);
+    offset = sizeof(header);
+    return true;
+}
+
+void RecordWriter::append(const PackedPosition& record) {
+    buffer.push_back(record);
+    count++;
+    if (buffer.size() == RECORDS_PER_BLOCK) {
+        flushBuffer();
+    }
+}
+
+void RecordWriter::flushBuffer() {
+    if (buffer.empty()) {
+        return;
+    }
+    if (compressed) {
+        encodeBlock(buffer.data(), buffer.size(), encoded);
+        blockOffsets.push_back(offset);
+        fwrite(encoded.data(), 1, encoded.size(), file);
+        offset += encoded.size();
+    } else {
+        fwrite(buffer.data(), sizeof(PackedPosition), buffer.size(), file);
+        offset += buffer.size() * sizeof(PackedPosition);
+    }
+    buffer.clear();
+}
+
+bool RecordWriter::finish() {
+    flushBuffer();
+    RecordFileHeader header = {};
+    memcpy(header.magic, RECORD_MAGIC, 8);
+    header.version = RECORD_VERSION;
+    header.flags = compressed ? FLAG_COMPRESSED : 0;
+    header.count = count;
+    if (compressed) {
+        // One extra offset marks the end of the last block. The table is padded to 8 bytes
+        // so the reader can use it in place.
+        blockOffsets.push_back(offset);
+        static const uint8_t padding[8] = {0};
+        fwrite(padding, 1, (8 - offset % 8) % 8, file);
+        offset += (8 - offset % 8) % 8;
+        header.blockTable = offset;
+        fwrite(blockOffsets.data(), sizeof(uint64_t), blockOffsets.size(), file);
+    }
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok && rename((path + ".tmp").c_str(), path.c_str()) == 0;
+}
+
+// Read-only view of a record file. Uncompressed records are returned straight from the
+// mapping; compressed ones from the reader's copy of the last block used, so a reader is
+// not shared between threads.
+class RecordReader {
+    public:
+        ~RecordReader();
+        bool open(const std::string& path);
+        uint64_t size() const { return count; }
+        bool isCompressed() const { return blockTable != nullptr; }
+        const PackedPosition* record(uint64_t index); // nullptr if out of range or corrupt
+    private:
+        void* mapping = nullptr;
+        size_t mappedBytes = 0;
+        uint64_t count = 0;
+        const PackedPosition* records = nullptr; // Uncompressed files
+        const uint64_t* blockTable = nullptr; // Compressed files, one offset per block plus the end
+        std::vector<PackedPosition> block;
+        uint64_t cachedBlock = ~0ULL;
+};
+
+RecordReader::~RecordReader() {
+    if (mapping != nullptr) {
+        munmap(mapping, mappedBytes);
+    }
+}
+
+bool RecordReader::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(RecordFileHeader)) {
+        close(fd);
+        return false;
+    }
+    mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        return false;
+    }
+    mappedBytes = info.st_size;
+    const uint8_t* bytes = static_cast<const uint8_t*>(mapping);
+    RecordFileHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, RECORD_MAGIC, 8) != 0 || header.version != RECORD_VERSION) {
+        return false;
+    }
+    count = header.count;
+    if (header.flags & FLAG_COMPRESSED) {
+        uint64_t blocks = (count + RECORDS_PER_BLOCK - 1) / RECORDS_PER_BLOCK;
+        if (header.blockTable % 8 != 0 || header.blockTable + (blocks + 1) * sizeof(uint64_t) > mappedBytes) {
+            return false;
+        }
+        blockTable = reinterpret_cast<const uint64_t*>(bytes + header.blockTable);
+        block.resize(RECORDS_PER_BLOCK);
+    } else {
+        if (sizeof(RecordFileHeader) + count * sizeof(PackedPosition) > mappedBytes) {
+            return false;
+        }
+        records = reinterpret_cast<const PackedPosition*>(bytes + sizeof(RecordFileHeader));
+    }
+    return true;
+}
+
+const PackedPosition* RecordReader::record(uint64_t index) {
+    if (index >= count) {
+        return nullptr;
+    }
+    if (records != nullptr) {
+        return &records[index];
+    }
+    uint64_t blockIndex = index / RECORDS_PER_BLOCK;
+    if (blockIndex != cachedBlock) {
+        uint64_t begin = blockTable[blockIndex];
+        uint64_t end = blockTable[blockIndex + 1];
+        size_t blockRecords = std::min<uint64_t>(RECORDS_PER_BLOCK, count - blockIndex * RECORDS_PER_BLOCK);
+        if (begin > end || end > mappedBytes ||
+            !decodeBlock(static_cast<const uint8_t*>(mapping) + begin, end - begin, block.data(), blockRecords)) {
+            cachedBlock = ~0ULL;
+            return nullptr;
+        }
+        cachedBlock = blockIndex;
+    }
+    return &block[index % RECORDS_PER_BLOCK];
+}
+
+static std::string toFen(const CompactPosition& position) {
+    std::string fen;
+    for (int y = 7; y >= 0; y--) {
+        int empty = 0;
+        for (int x = 0; x < 8; x++) {
+            int type = position.pieceOn(x + 8 * y);
+            if (type == -1) {
+                empty++;
+                continue;
+            }
+            if (empty > 0) {
+                fen += char('0' + empty);
+                empty = 0;
+            }
+            char symbol = "pnbrqk"[type];
+            fen += (position.byColor[0] >> (x + 8 * y)) & 1 ? char(symbol - 'a' + 'A') : symbol;
+        }
+        if (empty > 0) {
+            fen += char('0' + empty);
+        }
+        if (y > 0) {
+            fen += '/';
+        }
+    }
+    fen += position.whiteToMove ? " w " : " b ";
+    std::string castling;
+    if (position.castling & 1) castling += 'K';
+    if (position.castling & 2) castling += 'Q';
+    if (position.castling & 4) castling += 'k';
+    if (position.castling & 8) castling += 'q';
+    fen += castling.empty() ? "-" : castling;
+    if (position.enPassant == -1) {
+        fen += " -";
+    } else {
+        fen += ' ';
+        fen += char('a' + position.enPassant % 8);
+        fen += char('1' + position.enPassant / 8);
+    }
+    return fen + " " + std::to_string(position.rule50) + " " + std::to_string(position.ply / 2 + 1);
+}
+
+// Reads selfPlay output and writes one record per position before each move,
+// labelled with the game result and the move played
+static int exportGames(const char* gamesPath, const char* outPath, bool compress) {
+    FILE* games = fopen(gamesPath, "rb");
+    if (games == nullptr) {
+        std::cerr << "Cannot read " << gamesPath << std::endl;
+        return 1;
+    }
+    RecordWriter writer;
+    if (!writer.open(outPath, compress)) {
+        std::cerr << "Cannot write " << outPath << std::endl;
+        fclose(games);
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint8_t header[8];
+    std::vector<uint16_t> moves;
+    uint64_t gameCount = 0;
+    while (fread(header, 1, 8, games) == 8) {
+        uint16_t plies;
+        memcpy(&plies, header + 4, 2);
+        GameStatus status = (GameStatus)header[6];
+        moves.resize(plies);
+        if (fread(moves.data(), sizeof(uint16_t), plies, games) != plies) {
+            std::cerr << gamesPath << ": truncated game record" << std::endl;
+            break;
+        }
+        int8_t result = status == GameStatus::WhiteWins ? 1 : status == GameStatus::BlackWins ? -1 : 0;
+        CompactPosition position = CompactPosition::startPosition();
+        for (uint16_t move : moves) {
+            PackedPosition record;
+            if (!position.isLegal(move) || !record.pack(position)) {
+                std::cerr << gamesPath << ": invalid move in game " << gameCount << std::endl;
+                break;
+            }
+            record.result = result;
+            record.eval = 0;
+            record.bestMove = move;
+            writer.append(record);
+            position.makeMove(move);
+        }
+        gameCount++;
+    }
+    fclose(games);
+    if (!writer.finish()) {
+        std::cerr << "Cannot write " << outPath << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    struct stat info;
+    stat(outPath, &info);
+    std::cout << writer.size() << " positions from " << gameCount << " games, " << info.st_size << " bytes ("
+              << (double)info.st_size / std::max<uint64_t>(writer.size(), 1) << " per position) in "
+              << seconds << " s" << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: positionRecords export <games.bin> <out.rec> [--compress]\n"
+                     "       positionRecords dump <file.rec> [index...]\n"
+                     "       positionRecords scan <file.rec>" << std::endl;
+        return 2;
+    }
+    std::string command = argv[1];
+    if (command == "export" && argc >= 4) {
+        return exportGames(argv[2], argv[3], argc > 4 && std::string(argv[4]) == "--compress");
+    }
+
+    RecordReader reader;
+    if (!reader.open(argv[2])) {
+        std::cerr << "Cannot open " << argv[2] << std::endl;
+        return 1;
+    }
+    if (command == "dump") {
+        std::vector<uint64_t> indices;
+        for (int i = 3; i < argc; i++) {
+            indices.push_back(strtoull(argv[i], nullptr, 10));
+        }
+        if (indices.empty()) {
+            for (uint64_t i = 0; i < reader.size(); i++) {
+                indices.push_back(i);
+            }
+        }
+        for (uint64_t index : indices) {
+            const PackedPosition* record = reader.record(index);
+            if (record == nullptr) {
+                std::cerr << "No record " << index << std::endl;
+                return 1;
+            }
+            std::cout << toFen(record->unpack()) << " result " << (int)record->result << " eval " << record->eval
+                      << " best " << (record->bestMove ? moveText(record->bestMove) : "-") << std::endl;
+        }
+    } else if (command == "scan") {
+        // Touches every byte of every record so the figure reflects real reads
+        auto start = std::chrono::steady_clock::now();
+        uint64_t checksum = 0;
+        for (uint64_t i = 0; i < reader.size(); i++) {
+            const PackedPosition* record = reader.record(i);
+            if (record == nullptr) {
+                std::cerr << "Corrupt record " << i << std::endl;
+                return 1;
+            }
+            uint64_t words[4];
+            memcpy(words, record, sizeof(words));
+            checksum += words[0] ^ words[1] ^ words[2] ^ words[3];
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << reader.size() << " records" << (reader.isCompressed() ? " (compressed)" : "") << " in " << seconds
+                  << " s, " << (long long)(reader.size() / seconds) << " records/s, "
+                  << reader.size() * sizeof(PackedPosition) / seconds / 1e6 << " MB/s decoded, checksum "
+                  << std::hex << checksum << std::dec << std::endl;
+    } else {
+        std::cerr << "Unknown command " << command << std::endl;
+        return 2;
+    }
+    return 0;
+}
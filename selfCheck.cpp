@@ -0,0 +1,252 @@
+// Self-check for CompactPosition: perft against the published reference counts, then random
+// games played on CompactPosition and Board side by side, comparing legal moves and keys.
+// Board::isLegalBatch is checked on the same positions, for every move of the side to move,
+// and the search draw rules of Board on fixed move sequences.
+// Build: g++ -std=c++17 -O2 selfCheck.cpp -o selfCheck
+// Usage: selfCheck [games=200]
+// Exits with status 1 on the first disagreement.
+#include "chessRule.cpp"
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+
+// CompactPosition from a FEN string; no validation
+static CompactPosition fromFen(const std::string& fen) {
+    CompactPosition position = {};
+    std::istringstream fields(fen);
+    std::string placement, side, castling, enPassant;
+    int rule50 = 0, fullmove = 1;
+    fields >> placement >> side >> castling >> enPassant >> rule50 >> fullmove;
+    int x = 0, y = 7;
+    for (char c : placement) {
+        if (c == '/') {
+            y--;
+            x = 0;
+        } else if (c >= '1' && c <= '8') {
+            x += c - '0';
+        } else {
+            int type = std::string("pnbrqk").find(tolower(c));
+            position.byType[type] |= 1ULL << (x + 8 * y);
+            position.byColor[isupper(c) ? 0 : 1] |= 1ULL << (x + 8 * y);
+            x++;
+        }
+    }
+    position.whiteToMove = side == "w";
+    for (char c : castling) {
+        position.castling |= c == 'K' ? 1 : c == 'Q' ? 2 : c == 'k' ? 4 : c == 'q' ? 8 : 0;
+    }
+    position.enPassant = enPassant == "-" ? -1 : (enPassant[0] - 'a') + 8 * (enPassant[1] - '1');
+    position.rule50 = rule50;
+    position.ply = (fullmove - 1) * 2 + (position.whiteToMove ? 0 : 1);
+    position.key = position.computeKey();
+    return position;
+}
+
+static uint64_t perft(const CompactPosition& position, int depth) {
+    uint16_t moves[CompactPosition::MAX_MOVES];
+    int count = position.generateLegalMoves(moves);
+    if (depth == 1) {
+        return count;
+    }
+    uint64_t nodes = 0;
+    for (int i = 0; i < count; i++) {
+        CompactPosition next = position;
+        next.makeMove(moves[i]);
+        if (next.key != next.computeKey()) {
+            std::cerr << "incremental key differs from computeKey" << std::endl;
+            exit(1);
+        }
+        nodes += perft(next, depth - 1);
+    }
+    return nodes;
+}
+
+typedef std::vector<std::unique_ptr<Piece>> PieceList; // Board does not own its pieces
+
+static void place(Board& board, PieceList& pieces, Piece* piece, const char* square) {
+    pieces.emplace_back(piece);
+    board.placePiece(piece, {square[0] - 'a', square[1] - '1'});
+}
+
+static void setUpStartPosition(Board& board, PieceList& pieces) {
+    const char* backRank = "RNBQKBNR";
+    for (int color = 0; color < 2; color++) {
+        bool white = color == 0;
+        for (int x = 0; x < 8; x++) {
+            std::string home = {char('a' + x), white ? '1' : '8'};
+            std::string pawn = {char('a' + x), white ? '2' : '7'};
+            switch (backRank[x]) {
+                case 'R': place(board, pieces, new Rook(white), home.c_str()); break;
+                case 'N': place(board, pieces, new Knight(white), home.c_str()); break;
+                case 'B': place(board, pieces, new Bishop(white), home.c_str()); break;
+                case 'Q': place(board, pieces, new Queen(white), home.c_str()); break;
+                default: place(board, pieces, new King(white), home.c_str()); break;
+            }
+            place(board, pieces, new Pawn(white), pawn.c_str());
+        }
+    }
+    board.initializeBoardHistory();
+}
+
+// Plays coordinate moves such as e2e4 (no promotions); false at the first one isLegal rejects
+static bool play(Board& board, const std::string& moves) {
+    std::istringstream tokens(moves);
+    std::string move;
+    while (tokens >> move) {
+        std::pair<int, int> from = {move[0] - 'a', move[1] - '1'};
+        std::pair<int, int> to = {move[2] - 'a', move[3] - '1'};
+        if (!board.isLegal(from, to)) {
+            std::cerr << move << " rejected" << std::endl;
+            return false;
+        }
+        board.movePiece(from, to);
+    }
+    return true;
+}
+
+// Plays a random game on both representations, checking every position on the way
+static bool crossCheckGame(std::mt19937_64& rng) {
+    Board board;
+    board.consoleMessages = false;
+    PieceList pieces;
+    setUpStartPosition(board, pieces);
+
+    CompactPosition position = CompactPosition::startPosition();
+    uint16_t moves[CompactPosition::MAX_MOVES];
+    Board::PositionBatch batch;
+    std::vector<uint8_t> batchLegal;
+    for (int ply = 0; ply < 400; ply++) {
+        if (position.key != board.stateHistory.back().key) {
+            std::cerr << "ply " << ply << ": keys differ" << std::endl;
+            return false;
+        }
+        int count = position.generateLegalMoves(moves);
+        uint64_t expected[64] = {0};
+        for (int i = 0; i < count; i++) {
+            expected[moveFrom(moves[i])] |= 1ULL << moveTo(moves[i]);
+        }
+        batch.clear();
+        for (int square = 0; square < 64; square++) {
+            if (!((position.byColor[position.whiteToMove ? 0 : 1] >> square) & 1)) {
+                continue;
+            }
+            Board::LegalTargets targets = board.legalTargets({square % 8, square / 8});
+            if (targets.squares != expected[square]) {
+                std::cerr << "ply " << ply << ": legal destinations from square " << square << " differ ("
+                          << std::hex << targets.squares << " on Board, " << expected[square] << std::dec
+                          << " on CompactPosition)" << std::endl;
+                return false;
+            }
+            for (int to = 0; to < 64; to++) {
+                board.appendToBatch(batch, {square % 8, square / 8}, {to % 8, to / 8});
+            }
+        }
+        Board::isLegalBatch(batch, batchLegal);
+        for (size_t i = 0; i < batch.size(); i++) {
+            int from = batch.from[i], to = batch.to[i];
+            if (batchLegal[i] != ((expected[from] >> to) & 1)) {
+                std::cerr << "ply " << ply << ": isLegalBatch says " << (batchLegal[i] ? "legal" : "illegal")
+                          << " for square " << from << " to " << to << std::endl;
+                return false;
+            }
+        }
+        if (count == 0 || position.status(count) != GameStatus::Ongoing) {
+            bool mated = count == 0 && position.inCheck();
+            if (mated != board.isCheckmate(position.whiteToMove)) {
+                std::cerr << "ply " << ply << ": checkmate differs" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        uint16_t move = moves[rng() % count];
+        int from = moveFrom(move), to = moveTo(move);
+        board.movePiece({from % 8, from / 8}, {to % 8, to / 8}, movePromotion(move) ? "PNBRQK"[movePromotion(move)] : 'Q');
+        if (movePromotion(move)) {
+            pieces.emplace_back(board.board[to / 8][to % 8]);
+        }
+        position.makeMove(move);
+    }
+    return true;
+}
+
+// Repetition and fifty-move rules as Board::hasUpcomingRepetition and isDrawInSearch see them
+static bool checkSearchDraws() {
+    // Knights out and back twice. The start position recurs at ply 4, a draw inside a search
+    // of 5 plies. From ply 7 the side to move can reach a position that already repeated.
+    Board board;
+    board.consoleMessages = false;
+    PieceList pieces;
+    setUpStartPosition(board, pieces);
+    const char* shuffle[] = {"g1f3", "g8f6", "f3g1", "f6g8", "g1f3", "g8f6", "f3g1", "f6g8"};
+    for (int ply = 1; ply <= 8; ply++) {
+        if (!play(board, shuffle[ply - 1])) {
+            return false;
+        }
+        bool upcoming = board.hasUpcomingRepetition(0);
+        bool draw = board.isDrawInSearch(5);
+        if (upcoming != (ply >= 7) || draw != (ply >= 4)) {
+            std::cerr << "knight shuffle ply " << ply << ": hasUpcomingRepetition(0) " << upcoming
+                      << ", isDrawInSearch(5) " << draw << std::endl;
+            return false;
+        }
+    }
+
+    // 99 reversible player moves, then a rook move on the hundredth that is mate or quiet.
+    // Mate is still a win; the quiet move is a fifty-move draw.
+    for (int mate = 0; mate < 2; mate++) {
+        Board ending;
+        ending.consoleMessages = false;
+        PieceList endingPieces;
+        place(ending, endingPieces, new King(true), "h1");
+        place(ending, endingPieces, new King(false), "g3");
+        place(ending, endingPieces, new Rook(false), "a8");
+        ending.initializeBoardHistory();
+        for (int cycle = 0; cycle < 24; cycle++) {
+            if (!play(ending, "h1g1 a8b8 g1h1 b8a8")) {
+                return false;
+            }
+        }
+        if (!play(ending, mate ? "h1g1 a8b8 g1h1 b8b1" : "h1g1 a8b8 g1h1 b8c8")) {
+            return false;
+        }
+        if (ending.stateHistory.back().rule50 != 100 || ending.isDrawInSearch(0) != !mate) {
+            std::cerr << (mate ? "mate" : "quiet move") << " at rule50 " << ending.stateHistory.back().rule50
+                      << ": isDrawInSearch " << ending.isDrawInSearch(0) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int games = argc > 1 ? atoi(argv[1]) : 200;
+    struct PerftCase {
+        const char* fen;
+        int depth;
+        uint64_t nodes;
+    } cases[] = {
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 4, 197281},
+        {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 3, 97862},
+        {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624},
+        {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 4, 422333},
+        {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 3, 62379},
+    };
+    bool ok = true;
+    for (const PerftCase& test : cases) {
+        uint64_t nodes = perft(fromFen(test.fen), test.depth);
+        std::cout << "perft " << test.depth << " " << nodes << (nodes == test.nodes ? " ok  " : " FAIL ") << test.fen << std::endl;
+        ok = ok && nodes == test.nodes;
+    }
+
+    ok = ok && checkSearchDraws();
+
+    std::mt19937_64 rng(12345);
+    for (int i = 0; i < games && ok; i++) {
+        ok = crossCheckGame(rng);
+    }
+    std::cout << (ok ? "all checks passed" : "check failed") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+// Self-play data generator: plays independent games on every core with CompactPosition.
+//
+// Game i is seeded from the base seed and i alone, so a run reproduces the same games
+// whatever the thread count; threads take games from a shared counter. Games are
+// adjudicated by CompactPosition::status (mate, stalemate, fifty moves, insufficient
+// material) plus threefold repetition over the keys since the last irreversible move.
+// Records are written as they finish, so their order in the file depends on scheduling:
+//   uint32 game, uint16 plies, uint8 GameStatus, uint8 0, then plies moves (packMove format)
+//
+// Build: g++ -std=c++17 -O2 -march=native selfPlay.cpp -o selfPlay -pthread
+// Usage: selfPlay [games=100000] [policy=random|weighted|search] [threads=all] [seed=1] [out.bin]
+//   random    uniform over legal moves
+//   weighted  favours promotions and captures that do not lose material (seeGe)
+//   search    two-ply material search, ties broken at random
+#include "chessRule.cpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum class Policy { Random, Weighted, Search };
+
+static const int SEARCH_DEPTH = 2;
+static const int MATE_SCORE = 100000;
+
+// Negamax with alpha-beta on material. Leaves are not checked for mate, and fifty-move and
+// repetition draws are left to the game loop.
+static int search(const CompactPosition& position, int depth, int alpha, int beta) {
+    if (depth == 0) {
+        return position.materialBalance();
+    }
+    uint16_t moves[CompactPosition::MAX_MOVES];
+    int count = position.generateLegalMoves(moves);
+    if (count == 0) {
+        return position.inCheck() ? -MATE_SCORE - depth : 0; // Prefer the quickest mate
+    }
+    for (int i = 0; i < count; i++) {
+        CompactPosition next = position;
+        next.makeMove(moves[i]);
+        int score = -search(next, depth - 1, -beta, -alpha);
+        if (score > alpha) {
+            alpha = score;
+            if (alpha >= beta) {
+                break;
+            }
+        }
+    }
+    return alpha;
+}
+
+static uint16_t chooseMove(const CompactPosition& position, const uint16_t* moves, int count,
+                           Policy policy, SplitMix64& rng) {
+    if (policy == Policy::Weighted) {
+        int weights[CompactPosition::MAX_MOVES];
+        int total = 0;
+        for (int i = 0; i < count; i++) {
+            int weight = 1;
+            if (movePromotion(moves[i]) == QUEEN ||
+                (movePromotion(moves[i]) == 0 && position.pieceOn(moveFrom(moves[i])) == PAWN &&
+                 (moveTo(moves[i]) / 8 == 0 || moveTo(moves[i]) / 8 == 7))) {
+                weight = 16;
+            } else if (position.pieceOn(moveTo(moves[i])) != -1 && position.seeGe(moves[i], 0)) {
+                weight = 4 + position.see(moves[i]) / 100;
+            }
+            total += weight;
+            weights[i] = total;
+        }
+        uint32_t pick = rng.below(total);
+        int i = 0;
+        while (weights[i] <= (int)pick) {
+            i++;
+        }
+        return moves[i];
+    }
+    if (policy == Policy::Search) {
+        int best = -MATE_SCORE * 2;
+        int ties = 0;
+        uint16_t choice = moves[0];
+        for (int i = 0; i < count; i++) {
+            CompactPosition next = position;
+            next.makeMove(moves[i]);
+            int score = -search(next, SEARCH_DEPTH - 1, -MATE_SCORE * 2, -best + 1);
+            if (score > best) {
+                best = score;
+                ties = 1;
+                choice = moves[i];
+            } else if (score == best && rng.below(++ties) == 0) {
+                choice = moves[i]; // Reservoir sampling keeps each best move equally likely
+            }
+        }
+        return choice;
+    }
+    return moves[rng.below(count)];
+}
+
+// Plays one game to the end, appending the moves to record; returns the result
+static GameStatus playGame(uint64_t seed, Policy policy, std::vector<uint16_t>& record) {
+    SplitMix64 rng = {seed};
+    CompactPosition position = CompactPosition::startPosition();
+    KeyHistory history;
+    history.reset(position);
+    uint16_t moves[CompactPosition::MAX_MOVES];
+    while (true) {
+        int count = position.generateLegalMoves(moves);
+        GameStatus status = position.status(count);
+        if (status != GameStatus::Ongoing) {
+            return status;
+        }
+
+        // Threefold repetition: two earlier occurrences with the same side to move
+        if (history.repetitions(2) == 2) {
+            return GameStatus::DrawByRepetition;
+        }
+
+        uint16_t move = chooseMove(position, moves, count, policy, rng);
+        position.makeMove(move);
+        record.push_back(move);
+        history.push(position);
+    }
+}
+
+int main(int argc, char** argv) {
+    uint64_t gameCount = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+    std::string policyName = argc > 2 ? argv[2] : "random";
+    unsigned threadCount = argc > 3 && atoi(argv[3]) > 0 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    uint64_t seed = argc > 4 ? strtoull(argv[4], nullptr, 10) : 1;
+    FILE* out = nullptr;
+    if (argc > 5 && !(out = fopen(argv[5], "wb"))) {
+        std::cerr << "Cannot write " << argv[5] << std::endl;
+        return 1;
+    }
+    Policy policy;
+    if (policyName == "random") {
+        policy = Policy::Random;
+    } else if (policyName == "weighted") {
+        policy = Policy::Weighted;
+    } else if (policyName == "search") {
+        policy = Policy::Search;
+    } else {
+        std::cerr << "Unknown policy " << policyName << " (random, weighted or search)" << std::endl;
+        return 2;
+    }
+    if (threadCount == 0) {
+        threadCount = 1;
+    }
+
+    std::atomic<uint64_t> nextGame(0);
+    std::atomic<uint64_t> totalPlies(0);
+    std::atomic<uint64_t> results[(int)GameStatus::UnknownGame + 1] = {};
+    std::mutex outputMutex;
+    auto worker = [&]() {
+        std::vector<uint16_t> record;
+        std::vector<uint8_t> buffer; // Finished records, flushed to out in large blocks
+        uint64_t plies = 0;
+        for (uint64_t game; (game = nextGame.fetch_add(1)) < gameCount;) {
+            record.clear();
+            SplitMix64 seeder = {seed ^ (game * 0xD1B54A32D192ED03ULL)};
+            GameStatus status = playGame(seeder.next(), policy, record);
+            plies += record.size();
+            results[(int)status]++;
+            if (out) {
+                uint32_t index = (uint32_t)game;
+                uint16_t count = (uint16_t)record.size();
+                uint8_t header[8] = {0};
+                memcpy(header, &index, 4);
+                memcpy(header + 4, &count, 2);
+                header[6] = (uint8_t)status;
+                buffer.insert(buffer.end(), header, header + 8);
+                const uint8_t* bytes = reinterpret_cast<const uint8_t*>(record.data());
+                buffer.insert(buffer.end(), bytes, bytes + record.size() * sizeof(uint16_t));
+                if (buffer.size() >= (1 << 20)) {
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    fwrite(buffer.data(), 1, buffer.size(), out);
+                    buffer.clear();
+                }
+            }
+        }
+        if (out && !buffer.empty()) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            fwrite(buffer.data(), 1, buffer.size(), out);
+        }
+        totalPlies += plies;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; i++) {
+        threads.emplace_back(worker);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (out) {
+        fclose(out);
+    }
+
+    const char* names[] = {"ongoing", "white wins", "black wins", "stalemate", "repetition",
+                           "fifty moves", "insufficient material", "illegal move", "unknown game"};
+    std::cout << "games:           " << gameCount << " on " << threadCount << " threads (" << policyName << ")" << std::endl;
+    for (int i = 0; i <= (int)GameStatus::UnknownGame; i++) {
+        if (results[i]) {
+            std::cout << "  " << names[i] << ": " << results[i] << std::endl;
+        }
+    }
+    std::cout << "plies:           " << totalPlies << " (" << (double)totalPlies / gameCount << " per game)" << std::endl;
+    std::cout << "plies per second: " << (long long)(totalPlies / seconds) << std::endl;
+    return 0;
+}
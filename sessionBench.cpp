@@ -0,0 +1,60 @@
+// Benchmark for GameSessionManager: memory per game and moves per second with 100k live games.
+// Build: g++ -std=c++17 -O2 -march=native sessionBench.cpp -o sessionBench
+// Usage: sessionBench [games] [rounds]
+#include "chessRule.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+
+int main(int argc, char** argv) {
+    size_t gameCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    
+    GameSessionManager sessions;
+    std::vector<GameSessionManager::GameId> ids(gameCount);
+    for (size_t i = 0; i < gameCount; i++) {
+        ids[i] = sessions.createGame();
+    }
+    
+    // Each round sends one random legal move to every game, in a shuffled order so that
+    // lookups hit the slab the way independent clients would
+    std::mt19937_64 rng(2024);
+    std::vector<GameSessionManager::MoveRequest> requests(gameCount);
+    std::vector<GameStatus> results(gameCount);
+    std::vector<size_t> order(gameCount);
+    for (size_t i = 0; i < gameCount; i++) {
+        order[i] = i;
+    }
+    uint16_t moves[CompactPosition::MAX_MOVES];
+    double applySeconds = 0;
+    long long applied = 0, finished = 0;
+    for (int round = 0; round < rounds; round++) {
+        std::shuffle(order.begin(), order.end(), rng);
+        for (size_t i = 0; i < gameCount; i++) {
+            GameSessionManager::GameId id = ids[order[i]];
+            int count = sessions.position(id)->generateLegalMoves(moves);
+            requests[i] = {id, moves[rng() % count]};
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        sessions.applyMoves(requests.data(), gameCount, results.data());
+        applySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        applied += gameCount;
+        
+        // Replace finished games to keep the number of live games constant
+        for (size_t i = 0; i < gameCount; i++) {
+            if (results[i] != GameStatus::Ongoing) {
+                sessions.endGame(requests[i].game);
+                ids[order[i]] = sessions.createGame();
+                finished++;
+            }
+        }
+    }
+    
+    std::cout << "live games:         " << sessions.activeGames() << std::endl;
+    std::cout << "moves applied:      " << applied << " (" << finished << " games finished and replaced)" << std::endl;
+    std::cout << "moves per second:   " << (long long)(applied / applySeconds) << std::endl;
+    std::cout << "memory per game:    " << sessions.memoryUsage() / sessions.activeGames() << " bytes" << std::endl;
+    return 0;
+}